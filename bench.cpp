@@ -0,0 +1,515 @@
+#include <iostream>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+using namespace std;
+
+// Load generator for nologd: floods the journald sockets from several
+// clients and, when it starts the daemon itself, reads the daemon's stdout
+// to count the records that made it through and how long they took.
+//
+// Each record carries "nologd-bench CLIENT SEQUENCE TIMESTAMP", padded to
+// the requested size, anywhere in an output line.
+
+static const char *const socket_paths[] = {
+    "/run/systemd/journal/dev-log",
+    "/run/systemd/journal/socket",
+    "/run/systemd/journal/stdout"
+};
+
+static const char marker[] = "nologd-bench ";
+
+enum Target {
+    TARGET_SYSLOG,
+    TARGET_JOURNAL,
+    TARGET_STDOUT
+};
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Log-linear histogram of latencies in nanoseconds, 16 buckets for each
+// power of two, so percentiles are off by at most 1/16.
+class Histogram {
+    public:
+    Histogram() :
+        _buckets(64 * 16),
+        _count(0),
+        _max(0) {}
+
+    void record(uint64_t value)
+    {
+        _buckets[index(value)]++;
+        _count++;
+        _max = max(_max, value);
+    }
+
+    uint64_t count() const { return _count; }
+
+    uint64_t max_value() const { return _max; }
+
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = (uint64_t)(p / 100 * _count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < _buckets.size(); i++) {
+            seen += _buckets[i];
+            if (seen > rank)
+                return min(value(i), _max);
+        }
+        return _max;
+    }
+
+    private:
+    static size_t index(uint64_t value)
+    {
+        if (value < 16)
+            return value;
+        int exponent = 63 - __builtin_clzll(value);
+        return (exponent - 3) * 16 + ((value >> (exponent - 4)) & 15);
+    }
+
+    // Upper bound of the bucket.
+    static uint64_t value(size_t index)
+    {
+        if (index < 16)
+            return index;
+        int exponent = index / 16 + 3;
+        return ((16 + index % 16 + 1) << (exponent - 4)) - 1;
+    }
+
+    vector<uint64_t> _buckets;
+    uint64_t _count;
+    uint64_t _max;
+};
+
+struct Options {
+    vector<Target> targets;
+    int clients;
+    double rate;
+    size_t size;
+    double duration;
+    double drain;
+    bool nonblock;
+    char **command;
+
+    Options() :
+        clients(4),
+        rate(0),
+        size(128),
+        duration(5),
+        drain(2),
+        nonblock(false),
+        command(NULL) {}
+
+    static void usage(const char *prog)
+    {
+        cerr << "usage: " << prog << " [options] [-- COMMAND [ARG]...]" << endl
+             << "  -t, --target=TARGET  syslog, journal, stdout or all, may be given several" << endl
+             << "                       times, clients are spread over the targets (default all)" << endl
+             << "  -c, --clients=COUNT  number of sending clients, one thread each (default 4)" << endl
+             << "  -r, --rate=MSGS      messages per second of all clients together," << endl
+             << "                       0 sends as fast as possible (default 0)" << endl
+             << "  -s, --size=BYTES     size of a message (default 128)" << endl
+             << "  -d, --duration=SECS  how long to send (default 5)" << endl
+             << "  -w, --drain=SECS     how long to wait for the output afterwards (default 2)" << endl
+             << "  -n, --nonblock       don't wait for the daemon, count messages which" << endl
+             << "                       can't be sent right away as dropped" << endl
+             << "  -h, --help           show this help" << endl
+             << "COMMAND is started with its stdout read by the benchmark to measure the" << endl
+             << "records received and their latency, e.g. -- ./nologd -j 4" << endl;
+    }
+
+    void parse(int argc, char *argv[])
+    {
+        static const struct option long_options[] = {
+            { "target", required_argument, NULL, 't' },
+            { "clients", required_argument, NULL, 'c' },
+            { "rate", required_argument, NULL, 'r' },
+            { "size", required_argument, NULL, 's' },
+            { "duration", required_argument, NULL, 'd' },
+            { "drain", required_argument, NULL, 'w' },
+            { "nonblock", no_argument, NULL, 'n' },
+            { "help", no_argument, NULL, 'h' },
+            { NULL, 0, NULL, 0 }
+        };
+        int opt;
+        while ((opt = getopt_long(argc, argv, "+t:c:r:s:d:w:nh", long_options, NULL)) != -1) {
+            switch (opt) {
+            case 't':
+                if (!strcmp(optarg, "syslog")) {
+                    targets.push_back(TARGET_SYSLOG);
+                } else if (!strcmp(optarg, "journal")) {
+                    targets.push_back(TARGET_JOURNAL);
+                } else if (!strcmp(optarg, "stdout")) {
+                    targets.push_back(TARGET_STDOUT);
+                } else if (!strcmp(optarg, "all")) {
+                    targets.push_back(TARGET_SYSLOG);
+                    targets.push_back(TARGET_JOURNAL);
+                    targets.push_back(TARGET_STDOUT);
+                } else {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                clients = max(atoi(optarg), 1);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 's':
+                size = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'w':
+                drain = atof(optarg);
+                break;
+            case 'n':
+                nonblock = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                usage(argv[0]);
+                exit(1);
+            }
+        }
+        if (targets.empty()) {
+            targets.push_back(TARGET_SYSLOG);
+            targets.push_back(TARGET_JOURNAL);
+            targets.push_back(TARGET_STDOUT);
+        }
+        if (optind < argc)
+            command = argv + optind;
+    }
+};
+
+int unix_connect(int type, const char *path)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        strncpy(&sa.sun_path[0], path, sizeof(sa.sun_path) - 1);
+        if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// Sends messages to one socket at an even pace, or as fast as it can.
+class Client {
+    public:
+    Client(int id, Target target, const Options &options) :
+        _id(id),
+        _target(target),
+        _size(options.size),
+        _interval(options.rate > 0 ? options.clients * 1e9 / options.rate : 0),
+        _flags(options.nonblock ? MSG_DONTWAIT : 0),
+        _fd(-1),
+        _sent(0),
+        _dropped(0),
+        _bytes(0),
+        _error(0) {}
+
+    ~Client()
+    {
+        if (_fd >= 0)
+            close(_fd);
+    }
+
+    void run(uint64_t deadline)
+    {
+        _fd = unix_connect(_target == TARGET_STDOUT ? SOCK_STREAM : SOCK_DGRAM, socket_paths[_target]);
+        if (_fd < 0) {
+            _error = errno;
+            return;
+        }
+        // The header a native stream starts with: identifier, unit,
+        // priority, level prefix and forwarding to syslog, kmsg and console.
+        static const char header[] = "nologd-bench\n\n6\n0\n0\n0\n0\n";
+        if (_target == TARGET_STDOUT && send(_fd, header, sizeof(header) - 1, MSG_NOSIGNAL) < 0) {
+            _error = errno;
+            return;
+        }
+        string message;
+        uint64_t next = now();
+        for (uint64_t seq = 0;; seq++) {
+            uint64_t start = now();
+            if (start >= deadline)
+                break;
+            if (_interval > 0) {
+                if (start < next) {
+                    struct timespec ts = { (time_t)(next / 1000000000), (long)(next % 1000000000) };
+                    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+                }
+                next += _interval;
+            }
+            format(message, seq);
+            ssize_t len = send(_fd, message.data(), message.size(), _flags | MSG_NOSIGNAL);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                _dropped++;
+            } else if (len < 0) {
+                _error = errno;
+                break;
+            } else {
+                _sent++;
+                _bytes += _size;
+            }
+        }
+    }
+
+    uint64_t sent() const { return _sent; }
+
+    uint64_t dropped() const { return _dropped; }
+
+    uint64_t bytes() const { return _bytes; }
+
+    // errno of the failed connect() or send(), 0 if none failed
+    int error() const { return _error; }
+
+    private:
+    void format(string &message, uint64_t seq)
+    {
+        char text[96];
+        int len = snprintf(text, sizeof(text), "%s%d %llu %llu ", marker, _id,
+                           (unsigned long long)seq, (unsigned long long)now());
+        message.clear();
+        switch (_target) {
+        case TARGET_SYSLOG:
+            message.append("<14>");
+            break;
+        case TARGET_JOURNAL:
+            message.append("MESSAGE=");
+            break;
+        case TARGET_STDOUT:
+            break;
+        }
+        message.append(text, len);
+        if (_size > (size_t)len)
+            message.append(_size - len, 'x');
+        switch (_target) {
+        case TARGET_SYSLOG:
+            break;
+        case TARGET_JOURNAL:
+            message.append("\nPRIORITY=6\nSYSLOG_IDENTIFIER=nologd-bench\n");
+            break;
+        case TARGET_STDOUT:
+            message.append("\n");
+            break;
+        }
+    }
+
+    int _id;
+    Target _target;
+    size_t _size;
+    uint64_t _interval;
+    int _flags;
+    int _fd;
+    uint64_t _sent;
+    uint64_t _dropped;
+    uint64_t _bytes;
+    int _error;
+};
+
+// Reads the output of the daemon and matches it against what was sent.
+// Records are counted as soon as their marker fields are complete, nologd
+// only terminates a line when the next record starts.
+class Receiver {
+    public:
+    explicit Receiver(int fd) :
+        _fd(fd),
+        _received(0) {}
+
+    void run()
+    {
+        vector<char> buf(1024 * 1024 + 1);
+        size_t size = buf.size() - 1;
+        size_t used = 0;
+        for (;;) {
+            ssize_t len = ::read(_fd, &buf[used], size - used);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len <= 0)
+                break;
+            uint64_t arrival = now();
+            char *end = &buf[used + len];
+            *end = '\0';
+            char *pos = &buf[0];
+            char *found;
+            while ((found = (char *)memmem(pos, end - pos, marker, sizeof(marker) - 1)) != NULL) {
+                char *next = record(found + sizeof(marker) - 1, end, arrival);
+                if (next == NULL)
+                    break;
+                pos = next;
+            }
+            // Keep an incomplete record, or what may be the start of a marker.
+            char *keep = found ? found : max(pos, end - (sizeof(marker) - 1));
+            used = end - keep;
+            if (used == size)
+                used = 0;
+            else if (used > 0)
+                memmove(&buf[0], keep, used);
+        }
+    }
+
+    uint64_t received() const { return _received.load(memory_order_relaxed); }
+
+    const Histogram &latency() const { return _latency; }
+
+    private:
+    // Returns where the fields following a marker end, NULL if they don't
+    // yet.
+    char *record(char *pos, char *end, uint64_t arrival)
+    {
+        strtoul(pos, &pos, 10);
+        strtoull(pos, &pos, 10);
+        uint64_t sent = strtoull(pos, &pos, 10);
+        if (pos >= end)
+            return NULL;
+        if (sent > 0 && sent <= arrival)
+            _latency.record(arrival - sent);
+        _received.fetch_add(1, memory_order_relaxed);
+        return pos;
+    }
+
+    int _fd;
+    atomic<uint64_t> _received;
+    Histogram _latency;
+};
+
+// Starts the daemon with its stdout connected to a pipe.
+pid_t spawn(char **command, int *output)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execvp(command[0], command);
+        perror(command[0]);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    *output = fds[0];
+    return pid;
+}
+
+// Waits until the daemon listens on the socket bound last.
+bool wait_ready(pid_t pid, double timeout)
+{
+    uint64_t deadline = now() + timeout * 1e9;
+    while (now() < deadline) {
+        int fd = unix_connect(SOCK_STREAM, socket_paths[TARGET_STDOUT]);
+        if (fd >= 0) {
+            close(fd);
+            return true;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return false;
+        usleep(10000);
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    options.parse(argc, argv);
+
+    pid_t pid = -1;
+    int output = -1;
+    unique_ptr<Receiver> receiver;
+    thread reader;
+    if (options.command) {
+        pid = spawn(options.command, &output);
+        if (pid < 0 || !wait_ready(pid, 5)) {
+            cerr << options.command[0] << ": not ready" << endl;
+            return 1;
+        }
+        receiver.reset(new Receiver(output));
+        reader = thread(&Receiver::run, receiver.get());
+    }
+
+    vector<unique_ptr<Client>> clients;
+    for (int i = 0; i < options.clients; i++)
+        clients.emplace_back(new Client(i, options.targets[i % options.targets.size()], options));
+    uint64_t start = now();
+    uint64_t deadline = start + options.duration * 1e9;
+    vector<thread> threads;
+    for (auto &client : clients)
+        threads.emplace_back(&Client::run, client.get(), deadline);
+    for (auto &t : threads)
+        t.join();
+    double elapsed = (now() - start) / 1e9;
+
+    uint64_t sent = 0, dropped = 0, bytes = 0;
+    for (auto &client : clients) {
+        sent += client->sent();
+        dropped += client->dropped();
+        bytes += client->bytes();
+        if (client->error())
+            cerr << "client " << &client - &clients[0] << " failed: " << strerror(client->error()) << endl;
+    }
+
+    if (options.command) {
+        cout << "command:";
+        for (char **arg = options.command; *arg; arg++)
+            cout << " " << *arg;
+        cout << endl;
+    }
+    printf("sent     %llu messages in %.2f s: %.0f msg/s, %.1f MB/s\n", (unsigned long long)sent,
+           elapsed, sent / elapsed, bytes / elapsed / 1e6);
+    printf("dropped  %llu at send (%.3f%%)\n", (unsigned long long)dropped,
+           sent + dropped > 0 ? 100.0 * dropped / (sent + dropped) : 0.0);
+
+    if (receiver) {
+        uint64_t drain = now() + options.drain * 1e9;
+        while (receiver->received() < sent && now() < drain)
+            usleep(10000);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        reader.join();
+        close(output);
+        uint64_t received = receiver->received();
+        const Histogram &latency = receiver->latency();
+        printf("received %llu messages: %.0f msg/s, %.1f MB/s, lost %llu (%.3f%%)\n",
+               (unsigned long long)received, received / elapsed, received * options.size / elapsed / 1e6,
+               (unsigned long long)(sent > received ? sent - received : 0),
+               sent > 0 && sent > received ? 100.0 * (sent - received) / sent : 0.0);
+        if (latency.count() > 0)
+            printf("latency  p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+                   latency.percentile(50) / 1e3, latency.percentile(99) / 1e3,
+                   latency.percentile(99.9) / 1e3, latency.max_value() / 1e3);
+    }
+    return 0;
+}
@@ -1,16 +1,60 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <csignal>
 #include <memory>
 #include <exception>
 #include <functional>
 #include <list>
-#include <map>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <type_traits>
+#include <string>
 #include <string.h>
+#include <getopt.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <endian.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <syslog.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 using namespace std;
 
@@ -34,329 +78,6182 @@ struct ObservableInterface {
     virtual void delObserver(Key key) = 0;
 };
 
+// Event loop of a worker, see SocketObservable and UringObservable.
+struct EventLoopInterface : public ObservableInterface<int> {
+    // Workers own their loop through this interface, destroying it takes
+    // the observers and hooks, and with them the loggers, along.
+    virtual ~EventLoopInterface() {}
+    using ObservableInterface<int>::addObserver;
+    // flags are epoll event flags, loops without epoll map them as needed
+    virtual void addObserver(shared_ptr<Observer> &observer, uint32_t flags) = 0;
+    // Hooks run after each dispatched batch of events, e.g. to flush loggers.
+    virtual void addHook(function<void()> hook) = 0;
+    virtual void loop() = 0;
+    // Interrupts a loop running in another thread.
+    virtual void wakeup() = 0;
+
+    // Stops all loops, before returning they keep handling what is left in
+    // their sockets for up to drain_ms. Loops of other threads notice once
+    // they are woken up.
+    static void stop(int drain_ms);
+
+    // Stops the loops for the process to exec itself, see Handover. The
+    // sockets are passed on with what is queued in them.
+    static void upgrade()
+    {
+        upgrading = true;
+        stop(0);
+    }
+
+    static bool upgrade_requested() { return upgrading; }
+
+    protected:
+    static atomic<bool> stopped;
+    static atomic<bool> upgrading;
+    // CLOCK_MONOTONIC nanoseconds
+    static atomic<uint64_t> deadline;
+};
+atomic<bool> EventLoopInterface::stopped(false);
+atomic<bool> EventLoopInterface::upgrading(false);
+atomic<uint64_t> EventLoopInterface::deadline(0);
+
 struct ReaderInterface {
-    virtual void read(int sock_fd) = 0;
+    // Returns false once the peer has closed the connection.
+    virtual bool read(int sock_fd) = 0;
+    // Called once for every socket the reader is going to read.
+    virtual void attach(int sock_fd) {}
+};
+
+// Optional interface of datagram readers, lets a completion based event
+// loop receive messages on their behalf instead of signalling readiness.
+struct ReceiverInterface {
+    virtual size_t message_size() const = 0;
+    virtual size_t control_size() const = 0;
+    // msg only describes the ancillary data, the payload is buf.
+    virtual void receive(struct msghdr &msg, void *buf, size_t len) = 0;
+    // Called after the last message of a batch, before buffers are reused.
+    virtual void received() = 0;
+};
+
+// Optional interface of listening socket observers, lets an event loop
+// accept connections itself.
+struct AcceptorInterface {
+    virtual void accepted(ObservableInterface<int> &notification, int fd) = 0;
+};
+
+enum RecordSource {
+    SOURCE_NONE,
+    SOURCE_SYSLOG,
+    SOURCE_JOURNAL,
+    SOURCE_STDOUT
+};
+
+// Non-owning reference into a received record.
+struct StringRef {
+    const char *data;
+    size_t len;
+
+    bool operator==(const char *str) const
+    {
+        return strlen(str) == len && !memcmp(data, str, len);
+    }
+};
+
+struct JournalField {
+    StringRef name;
+    StringRef value;
+};
+
+class StreamHeader;
+
+// What the handler knows about a record besides its text.
+struct RecordInfo {
+    RecordInfo(int source = SOURCE_NONE, int priority = -1, const vector<JournalField> *fields = NULL,
+               const StreamHeader *stream = NULL) :
+        source(source),
+        priority(priority),
+        fields(fields),
+        stream(stream),
+        framed(false) {}
+
+    int source;
+    // syslog facility and severity, -1 when unknown
+    int priority;
+    // all fields of a journal entry, they point into the received datagram
+    // and are only valid in the stages of the pipeline, never in a logger
+    const vector<JournalField> *fields;
+    // the header of the stdout stream connection a line came from, likewise
+    // only valid in the stages
+    const StreamHeader *stream;
+    // The record brings its own framing, see EncodeStage, loggers write it
+    // without a separator.
+    bool framed;
 };
 
 struct LoggerInterface {
     virtual void write(const char *buf, int len) = 0;
+    virtual void write(const char *buf, int len, const RecordInfo &info) { write(buf, len); }
+    virtual void flush() {}
 };
 
 struct HandlerInterface {
     virtual void handle(char *buf, int len) = 0;
+    // Records whose reader knows more about them than their text.
+    virtual void handle(char *buf, int len, const RecordInfo &info) { handle(buf, len); }
+    virtual void handle(struct iovec *records, int count)
+    {
+        for (int i = 0; i < count; i++)
+            handle((char *)records[i].iov_base, records[i].iov_len);
+    }
+    // Lets stages holding records back pass on what is due, or all they
+    // hold when the worker stops.
+    virtual void expire(bool) {}
 };
 
 //
 // Implementation
 //
 
-class SocketReader : public ReaderInterface {
+// Link to the next stage of a handler chain. Stages built from a shared_ptr
+// share its ownership, stages built from a plain pointer borrow it from
+// whoever assembled the chain and outlives it, e.g. the pooled connections
+// of a listener, which then cost no reference count updates to set up.
+template <class T>
+class StageRef {
     public:
-    explicit SocketReader(shared_ptr<HandlerInterface> &handler) :
-        _handler(handler) {}
-    ~SocketReader() {}
-    void read(int sock_fd)
-    {
-        int len;
-        char buf[2048];
-        while ((len = ::read(sock_fd, buf, NELEMS(buf) - 1)) > 0)
-            _handler->handle(buf, len);
-    }
+    StageRef(T *stage = NULL) :
+        _stage(stage) {}
+    template <class U>
+    StageRef(const shared_ptr<U> &owner) :
+        _owner(owner),
+        _stage(owner.get()) {}
+
+    T *operator->() const { return _stage; }
+    T &operator*() const { return *_stage; }
+    explicit operator bool() const { return _stage != NULL; }
+
     private:
-    shared_ptr<HandlerInterface> _handler;
+    shared_ptr<T> _owner;
+    T *_stage;
 };
 
-class StreamHandler : public HandlerInterface {
+// Written by its own thread only, a relaxed load and store do without a
+// locked instruction. Other threads may read it at any time.
+class Counter {
     public:
-    explicit StreamHandler(shared_ptr<LoggerInterface> &logger) :
-        _logger(logger) {}
-    ~StreamHandler() {}
-    void handle(char *buf, int len) { _logger->write(buf, len); }
+    Counter() :
+        _value(0) {}
+
+    void add(uint64_t n = 1) { _value.store(_value.load(memory_order_relaxed) + n, memory_order_relaxed); }
+
+    // For counters used as a gauge.
+    void set(uint64_t n) { _value.store(n, memory_order_relaxed); }
+
+    uint64_t value() const { return _value.load(memory_order_relaxed); }
+
     private:
-    shared_ptr<LoggerInterface> _logger;
+    atomic<uint64_t> _value;
 };
 
-class SyslogHandler : public HandlerInterface {
+// Counts values in power of two buckets.
+class Log2Histogram {
     public:
-    explicit SyslogHandler(shared_ptr<LoggerInterface> &logger) :
-        _logger(logger) {}
-    ~SyslogHandler() {}
-    void handle(char *buf, int len)
+    void add(uint64_t value) { _buckets[value == 0 ? 0 : 64 - __builtin_clzll(value)].add(); }
+
+    uint64_t count() const
     {
-        int start = 0;
-        int end = len - 1;
-        // Drop numerically coded log level and facility as we perform no
-        // filtering based on this information.
-        if (start < len && buf[start] == '<') {
-            do ++start; while (start < len && isdigit(buf[start]));
-            if (buf[start] == '>')
-                ++start;
-        }
-        while (end > 0 && buf[end] == '\n')
-            buf[end--] = '\0';
-        _logger->write(buf + start, end - start);
+        uint64_t count = 0;
+        for (auto &bucket : _buckets)
+            count += bucket.value();
+        return count;
+    }
+
+    // Upper bound of the bucket holding the given percentile.
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = (uint64_t)(p / 100 * count());
+        uint64_t seen = 0;
+        for (size_t i = 0; i < NELEMS(_buckets); i++) {
+            seen += _buckets[i].value();
+            if (seen > rank)
+                return i == 0 ? 0 : (2ULL << (i - 1)) - 1;
+        }
+        return 0;
     }
+
     private:
-    shared_ptr<LoggerInterface> _logger;
+    Counter _buckets[65];
 };
 
-class JournalHandler : public HandlerInterface {
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+// Binds the calling thread to a set of CPUs while it lives and restores the
+// previous affinity afterwards. Threads started meanwhile inherit the set,
+// and memory first touched meanwhile is taken from the NUMA node of those
+// CPUs under the default first-touch policy, so buffers allocated under a
+// binding are local to the threads later pinned to the same CPUs.
+class CpuBinding {
     public:
-    explicit JournalHandler(shared_ptr<LoggerInterface> &logger) :
-        _logger(logger) {}
-    ~JournalHandler() {}
-    void handle(char *buf, int len)
+    explicit CpuBinding(const vector<int> &cpus) :
+        _bound(false)
+    {
+        if (cpus.empty() || sched_getaffinity(0, sizeof(_saved), &_saved) < 0)
+            return;
+        _bound = pin(cpus);
+    }
+
+    ~CpuBinding()
+    {
+        if (_bound)
+            sched_setaffinity(0, sizeof(_saved), &_saved);
+    }
+
+    // Binds the calling thread for good.
+    static bool pin(const vector<int> &cpus)
+    {
+        if (cpus.empty())
+            return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus)
+            CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == 0)
+            return true;
+        cerr << "cannot bind to cpu " << cpus[0] << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    // Parses a list like "0,2-3".
+    static bool parse(const char *list, vector<int> &cpus)
     {
-        for (int pos = 0; pos < len; pos++)
-            if (buf[pos] == '\n')
-                buf[pos] = ' ';
-        _logger->write(buf, len);
+        cpus.clear();
+        const char *pos = list;
+        for (;;) {
+            char *end;
+            long first = strtol(pos, &end, 10);
+            long last = first;
+            if (end == pos || first < 0)
+                return false;
+            if (*end == '-') {
+                pos = end + 1;
+                last = strtol(pos, &end, 10);
+                if (end == pos || last < first)
+                    return false;
+            }
+            if (last >= CPU_SETSIZE)
+                return false;
+            for (long cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+            if (*end == '\0')
+                return true;
+            if (*end != ',')
+                return false;
+            pos = end + 1;
+        }
     }
+
     private:
-    shared_ptr<LoggerInterface> _logger;
+    cpu_set_t _saved;
+    bool _bound;
 };
 
-class FileLogger : public LoggerInterface {
-    public:
-    explicit FileLogger(int fileno) :
-        _fileno(fileno) {}
-    ~FileLogger() {}
-    void write(const char *buf, int len)
+void EventLoopInterface::stop(int drain_ms)
+{
+    deadline = monotonic_ns() + drain_ms * 1000000ULL;
+    stopped = true;
+}
+
+// Wall clock time of the current event loop wakeup. The loops tick it once
+// per wakeup from the coarse clock, records handled in that wakeup share it.
+// The monotonic time of the wakeup is taken along, for intervals which a
+// step of the wall clock must not skew.
+struct WallClock {
+    static void tick()
+    {
+        clock_gettime(CLOCK_REALTIME_COARSE, &_now);
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        _ticks = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    static const struct timespec &now()
+    {
+        if (_now.tv_sec == 0)
+            tick();
+        return _now;
+    }
+
+    // CLOCK_MONOTONIC_COARSE nanoseconds
+    static uint64_t ticks()
     {
-        ::write(_fileno, "\n", 1);
-        ::write(_fileno, buf, len);
+        if (_now.tv_sec == 0)
+            tick();
+        return _ticks;
     }
+
     private:
-    int _fileno;
+    static thread_local struct timespec _now;
+    static thread_local uint64_t _ticks;
 };
+thread_local struct timespec WallClock::_now;
+thread_local uint64_t WallClock::_ticks;
 
-void epoll_addwatch(int epoll_fd, int sock_fd)
-{
-    struct epollin_event:epoll_event {
-        epollin_event(int fd)
-        {
-            events = EPOLLIN;
-            data.fd = fd;
+// Counters of a single thread, every event loop and writer thread attaches
+// its own set, so updating them costs no more than an increment. All sets
+// are printed to stderr on SIGUSR1.
+struct Metrics {
+    struct Source {
+        Counter reads;
+        // reads which found the socket empty, or short recvmmsg() batches
+        // which stood in for them
+        Counter eagain;
+        Counter records;
+        Counter bytes;
+        // datagrams cut at the receive buffer size, stream lines split at
+        // the reassembly buffer size
+        Counter truncated;
+        // datagrams of senders over their rate limit
+        Counter suppressed;
+        // repeats collapsed by a DedupStage
+        Counter repeated;
+        // datagrams the kernel reported as dropped with SO_RXQ_OVFL
+        Counter dropped;
+        // datagrams drained per wakeup
+        Log2Histogram depth;
+        // drains which found more datagrams than the socket queue holds,
+        // senders were blocked or had theirs refused meanwhile
+        Counter saturated;
+    };
+
+    explicit Metrics(const string &name) :
+        name(name) {}
+
+    string name;
+    Source sources[SOURCE_STDOUT + 1];
+    Counter wakeups;
+    Log2Histogram events;
+    // busy polling: events found while spinning, checks that found none and
+    // the nanoseconds they took, and waits that blocked after all
+    Counter spin_hits;
+    Counter spin_misses;
+    Counter spin_ns;
+    Counter sleeps;
+    // nanoseconds from a wakeup until its events and hooks are handled
+    Log2Histogram dispatch;
+    Counter writes;
+    // nanoseconds per write to the output
+    Log2Histogram write;
+    // buffered bytes the output failed to take
+    Counter write_dropped;
+    Counter streams_opened;
+    Counter streams_closed;
+    // connections closed right away while out of fds
+    Counter streams_refused;
+    // frames and bytes handed to the forwarding peer, frames dropped from
+    // a full spill queue and bytes waiting in it
+    Counter forward_frames;
+    Counter forward_bytes;
+    Counter forward_dropped;
+    Counter forward_backlog;
+
+    static Metrics &local()
+    {
+        if (_local == NULL)
+            attach("thread");
+        return *_local;
+    }
+
+    static void attach(const string &name)
+    {
+        lock_guard<mutex> guard(_lock);
+        _all.emplace_back(new Metrics(name));
+        _local = _all.back().get();
+    }
+
+    // The dump is done by the next loop to finish a wakeup.
+    static void request() { _requested = true; }
+
+    static void dump_requested()
+    {
+        if (!_requested.load(memory_order_relaxed) || !_requested.exchange(false))
+            return;
+        lock_guard<mutex> guard(_lock);
+        for (auto &metrics : _all)
+            metrics->dump(cerr);
+    }
+
+    private:
+    void dump(ostream &out) const
+    {
+        static const char *const source_names[] = { NULL, "syslog", "journal", "stdout" };
+        out << name << ":" << endl;
+        for (int i = SOURCE_SYSLOG; i <= SOURCE_STDOUT; i++) {
+            const Source &source = sources[i];
+            if (source.reads.value() == 0 && source.records.value() == 0)
+                continue;
+            out << "  " << source_names[i] << ": reads " << source.reads.value()
+                << ", eagain " << source.eagain.value()
+                << ", records " << source.records.value()
+                << ", bytes " << source.bytes.value()
+                << ", truncated " << source.truncated.value()
+                << ", suppressed " << source.suppressed.value()
+                << ", repeated " << source.repeated.value() << endl;
+            if (source.depth.count() > 0)
+                out << "  " << source_names[i] << ": depth p50 " << source.depth.percentile(50)
+                    << " p99 " << source.depth.percentile(99)
+                    << ", saturated " << source.saturated.value()
+                    << ", dropped " << source.dropped.value() << endl;
         }
-    } ev (sock_fd);
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev);
+        if (wakeups.value() > 0)
+            out << "  wakeups " << wakeups.value()
+                << ", events p50 " << events.percentile(50) << " p99 " << events.percentile(99)
+                << ", dispatch ns p50 " << dispatch.percentile(50) << " p99 " << dispatch.percentile(99)
+                << " p999 " << dispatch.percentile(99.9) << endl;
+        if (spin_hits.value() > 0 || spin_misses.value() > 0)
+            out << "  busy poll hits " << spin_hits.value()
+                << ", sleeps " << sleeps.value()
+                << ", empty polls " << spin_misses.value()
+                << ", spun ms " << spin_ns.value() / 1000000 << endl;
+        if (writes.value() > 0)
+            out << "  writes " << writes.value()
+                << ", write ns p50 " << write.percentile(50) << " p99 " << write.percentile(99)
+                << " p999 " << write.percentile(99.9)
+                << ", dropped bytes " << write_dropped.value() << endl;
+        if (streams_opened.value() > 0)
+            out << "  streams active " << streams_opened.value() - streams_closed.value()
+                << ", opened " << streams_opened.value()
+                << ", refused " << streams_refused.value() << endl;
+        if (forward_frames.value() > 0 || forward_backlog.value() > 0 || forward_dropped.value() > 0)
+            out << "  forward frames " << forward_frames.value()
+                << ", bytes " << forward_bytes.value()
+                << ", backlog " << forward_backlog.value()
+                << ", dropped " << forward_dropped.value() << endl;
+    }
+
+    static thread_local Metrics *_local;
+    static atomic<bool> _requested;
+    static mutex _lock;
+    static vector<unique_ptr<Metrics>> _all;
+};
+thread_local Metrics *Metrics::_local = NULL;
+atomic<bool> Metrics::_requested(false);
+mutex Metrics::_lock;
+vector<unique_ptr<Metrics>> Metrics::_all;
+
+// Newline scanning kernels, the fastest variant for the running CPU is
+// picked once at startup.
+struct NewlineKernels {
+    // Returns the first '\n' in buf or NULL.
+    char *(*find)(char *buf, size_t len);
+    // Replaces every '\n' in buf with c.
+    void (*replace)(char *buf, size_t len, char c);
+};
+
+static char *find_newline_scalar(char *buf, size_t len)
+{
+    for (size_t pos = 0; pos < len; pos++)
+        if (buf[pos] == '\n')
+            return buf + pos;
+    return NULL;
 }
 
-void fd_set_nonblock(int fd)
+static void replace_newlines_scalar(char *buf, size_t len, char c)
 {
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    for (size_t pos = 0; pos < len; pos++)
+        if (buf[pos] == '\n')
+            buf[pos] = c;
 }
 
-int unix_open(int type, const char *path)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static char *find_newline_sse2(char *buf, size_t len)
 {
-    struct sockaddr_un sa = { .sun_family = AF_UNIX };
-    int fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
-    if (fd >= 0) {
-        unlink(path);
-        strncpy(&sa.sun_path[0], path, NELEMS(sa.sun_path));
-        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
-            close(fd);
-            return -1;
-        }
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t pos = 0;
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *)(buf + pos));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(data, nl));
+        if (mask)
+            return buf + pos + __builtin_ctz(mask);
     }
-    return fd;
+    return find_newline_scalar(buf + pos, len - pos);
 }
 
-int unix_accept(int stdout_fd)
+__attribute__((target("sse2")))
+static void replace_newlines_sse2(char *buf, size_t len, char c)
 {
-    int fd;
-    struct sockaddr_un sa;
-    socklen_t slen = sizeof(sa);
-    fd = accept4(stdout_fd, (struct sockaddr *)&sa, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC);
-    return fd;
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i with = _mm_set1_epi8(c);
+    size_t pos = 0;
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *)(buf + pos));
+        __m128i match = _mm_cmpeq_epi8(data, nl);
+        if (_mm_movemask_epi8(match))
+            _mm_storeu_si128((__m128i *)(buf + pos),
+                             _mm_or_si128(_mm_and_si128(match, with), _mm_andnot_si128(match, data)));
+    }
+    replace_newlines_scalar(buf + pos, len - pos, c);
 }
 
-class SocketObservable : public ObservableInterface<int> {
-    public:
-    SocketObservable() :
-        epoll_fd(epoll_create1(EPOLL_CLOEXEC)) {}
-    ~SocketObservable() {}
+__attribute__((target("avx2")))
+static char *find_newline_avx2(char *buf, size_t len)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t pos = 0;
+    for (; pos + 32 <= len; pos += 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i *)(buf + pos));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(data, nl));
+        if (mask)
+            return buf + pos + __builtin_ctz(mask);
+    }
+    return find_newline_sse2(buf + pos, len - pos);
+}
 
-    void addObserver(shared_ptr<Observer> &observer)
-    {
-        if (observers.find(observer->key()) == observers.end())
-            epoll_addwatch(epoll_fd, observer->key());
-        observers[observer->key()] = observer;
+__attribute__((target("avx2")))
+static void replace_newlines_avx2(char *buf, size_t len, char c)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i with = _mm256_set1_epi8(c);
+    size_t pos = 0;
+    for (; pos + 32 <= len; pos += 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i *)(buf + pos));
+        __m256i match = _mm256_cmpeq_epi8(data, nl);
+        if (_mm256_movemask_epi8(match))
+            _mm256_storeu_si256((__m256i *)(buf + pos), _mm256_blendv_epi8(data, with, match));
     }
+    replace_newlines_sse2(buf + pos, len - pos, c);
+}
+#endif
 
-    void delObserver(int key)
+static NewlineKernels select_newline_kernels()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return { find_newline_avx2, replace_newlines_avx2 };
+    if (__builtin_cpu_supports("sse2"))
+        return { find_newline_sse2, replace_newlines_sse2 };
+#endif
+    return { find_newline_scalar, replace_newlines_scalar };
+}
+
+static const NewlineKernels newline = select_newline_kernels();
+
+// What follows the backslash when a byte is escaped in a JSON string, 'u'
+// for \u00XX, 0 for bytes copied as they are. Bytes from 0x80 up are marked
+// '8', they start a UTF-8 sequence which is validated before it is copied.
+struct JsonEscapes {
+    char table[256];
+
+    JsonEscapes()
     {
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, key, NULL);
-        observers.erase(key);
+        memset(table, 0, sizeof(table));
+        for (int c = 0; c < 0x20; c++)
+            table[c] = 'u';
+        table[(int)'\b'] = 'b';
+        table[(int)'\f'] = 'f';
+        table[(int)'\n'] = 'n';
+        table[(int)'\r'] = 'r';
+        table[(int)'\t'] = 't';
+        table[(int)'"'] = '"';
+        table[(int)'\\'] = '\\';
+        for (int c = 0x80; c < 0x100; c++)
+            table[c] = '8';
     }
+};
 
-    void delObserver(shared_ptr<Observer> &observer)
-    {
-        delObserver(observer->key());
+static const JsonEscapes json_escapes;
+
+// Returns the first byte of buf to be escaped or validated, or buf + len.
+static const char *find_json_escape_scalar(const char *buf, size_t len)
+{
+    const char *end = buf + len;
+    while (buf < end && !json_escapes.table[(unsigned char)*buf])
+        ++buf;
+    return buf;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static const char *find_json_escape_sse2(const char *buf, size_t len)
+{
+    const __m128i control = _mm_set1_epi8(0x1f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t pos = 0;
+    for (; pos + 16 <= len; pos += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *)(buf + pos));
+        __m128i match = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(data, control), data),
+                                     _mm_or_si128(_mm_cmpeq_epi8(data, quote), _mm_cmpeq_epi8(data, backslash)));
+        unsigned mask = _mm_movemask_epi8(match) | _mm_movemask_epi8(data);
+        if (mask)
+            return buf + pos + __builtin_ctz(mask);
     }
+    return find_json_escape_scalar(buf + pos, len - pos);
+}
 
-    void loop() throw (runtime_error)
-    {
-        /* Ignore flush request for time being */
-        signal(SIGUSR1, SIG_IGN);
-        signal(SIGHUP, SIG_IGN);
-        signal(SIGINT, SocketObservable::stop);
-        signal(SIGTERM, SocketObservable::stop);
+__attribute__((target("avx2")))
+static const char *find_json_escape_avx2(const char *buf, size_t len)
+{
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t pos = 0;
+    for (; pos + 32 <= len; pos += 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i *)(buf + pos));
+        __m256i match = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(data, control), data),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(data, quote),
+                                                        _mm256_cmpeq_epi8(data, backslash)));
+        unsigned mask = _mm256_movemask_epi8(match) | _mm256_movemask_epi8(data);
+        if (mask)
+            return buf + pos + __builtin_ctz(mask);
+    }
+    return find_json_escape_sse2(buf + pos, len - pos);
+}
+#endif
 
-        struct epoll_event ev;
-        while (!stopped) {
-            int r = epoll_wait(epoll_fd, &ev, 1, -1);
-            if (r < 0 && errno != EINTR)
-                throw runtime_error("epoll_wait failed");
-            if (observers.find(ev.data.fd) != observers.end())
-                observers.at(ev.data.fd)->notify(*this);
+typedef const char *(*JsonEscapeKernel)(const char *buf, size_t len);
+
+static JsonEscapeKernel select_json_escape_kernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_json_escape_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return find_json_escape_sse2;
+#endif
+    return find_json_escape_scalar;
+}
+
+static const JsonEscapeKernel find_json_escape = select_json_escape_kernel();
+
+// Datagrams a reader takes from one socket per wakeup. The datagram sockets
+// are level triggered, whatever is left is reported again after the other
+// ready sockets had their turn.
+static const int read_budget = 256;
+
+// Pid of the sender of a message received with SO_PASSCRED, 0 if unknown.
+static pid_t sender_pid(struct msghdr &hdr)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS &&
+            cmsg->cmsg_len >= CMSG_LEN(sizeof(struct ucred))) {
+            struct ucred cred;
+            memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+            return cred.pid;
         }
     }
+    return 0;
+}
+
+// Per sender token buckets of a socket, keyed by the pid the kernel attests.
+// A bucket is a single theoretical arrival time (GCRA): a sender may send
+// burst messages at once and then one every interval / burst. Buckets live
+// in a fixed open addressing table, a sender finding its probe window full
+// takes over the bucket which has been idle for longest.
+class RateLimiter {
+    public:
+    struct Summary {
+        pid_t pid;
+        unsigned suppressed;
+    };
 
-    static void stop(int signo)
+    RateLimiter(unsigned burst, uint64_t interval_ns) :
+        _step(interval_ns / max(burst, 1U)),
+        _tolerance(interval_ns - _step)
     {
-        cout << "stopped signo = " << signo << endl;
-        stopped = true;
+        memset(_buckets, 0, sizeof(_buckets));
     }
 
-    private:
-    int epoll_fd;
-    map<int, shared_ptr<Observer>> observers;
-    static bool stopped;
-};
-bool SocketObservable::stopped = false;
+    // Returns false when the message is to be suppressed. A summary of the
+    // messages suppressed before is handed out once a sender is let through
+    // again, or once its bucket is taken over.
+    bool allow(pid_t pid, uint64_t now, Summary &summary)
+    {
+        summary.suppressed = 0;
+        if (pid <= 0)
+            return true;
+        Bucket *bucket = find(pid);
+        if (bucket->pid != (uint32_t)pid) {
+            summary.pid = bucket->pid;
+            summary.suppressed = bucket->suppressed;
+            bucket->pid = pid;
+            bucket->suppressed = 0;
+            bucket->tat = now;
+        }
+        uint64_t tat = max(bucket->tat, now);
+        if (tat - now > _tolerance) {
+            ++bucket->suppressed;
+            return false;
+        }
+        bucket->tat = tat + _step;
+        if (bucket->suppressed > 0) {
+            summary.pid = pid;
+            summary.suppressed = bucket->suppressed;
+            bucket->suppressed = 0;
+        }
+        return true;
+    }
 
-class SyslogObserver : public ObservableInterface<int>::Observer {
-    public:
-    explicit SyslogObserver(shared_ptr<ReaderInterface> reader) :
-        sock_fd(unix_open(SOCK_DGRAM, "/run/systemd/journal/dev-log")),
-        _reader(reader)
+    // Formats a summary as a record of the given source.
+    static string report(const Summary &summary, int source)
     {
-        if (sock_fd < 0)
-            throw runtime_error("socket failed");
-        fd_set_nonblock(sock_fd);
-        symlink("/run/systemd/journal/dev-log", "/dev/log");
+        string text = "nologd: suppressed " + to_string(summary.suppressed) +
+            " messages from pid " + to_string(summary.pid);
+        // syslog facility, notice severity
+        if (source == SOURCE_JOURNAL)
+            return "MESSAGE=" + text + "\nPRIORITY=5\nSYSLOG_FACILITY=5\n";
+        return "<45>" + text;
     }
 
-    ~SyslogObserver() { close(sock_fd); }
+    private:
+    struct Bucket {
+        uint32_t pid;
+        uint32_t suppressed;
+        uint64_t tat;
+    };
 
-    void notify(ObservableInterface<int> &notification) { _reader->read(sock_fd); }
+    static const unsigned table_bits = 10;
+    static const unsigned probes = 8;
 
-    int key() const { return sock_fd; }
+    Bucket *find(pid_t pid)
+    {
+        unsigned home = ((uint32_t)pid * 2654435761U) >> (32 - table_bits);
+        Bucket *oldest = NULL;
+        for (unsigned i = 0; i < probes; i++) {
+            Bucket *bucket = &_buckets[(home + i) & ((1U << table_bits) - 1)];
+            if (bucket->pid == (uint32_t)pid || bucket->pid == 0)
+                return bucket;
+            if (oldest == NULL || bucket->tat < oldest->tat)
+                oldest = bucket;
+        }
+        return oldest;
+    }
 
-    private:
-    int sock_fd;
-    shared_ptr<ReaderInterface> _reader;
+    uint64_t _step;
+    uint64_t _tolerance;
+    Bucket _buckets[1U << table_bits];
 };
 
-class SocketObserver : public ObservableInterface<int>::Observer {
+class SocketReader : public ReaderInterface {
     public:
-    explicit SocketObserver(shared_ptr<ReaderInterface> reader) :
-        sock_fd(unix_open(SOCK_DGRAM, "/run/systemd/journal/socket")),
-        _reader(reader)
+    SocketReader(StageRef<HandlerInterface> handler, int source,
+                 shared_ptr<RateLimiter> limiter = shared_ptr<RateLimiter>()) :
+        _handler(handler),
+        _source(source),
+        _limiter(limiter) {}
+    ~SocketReader() {}
+    bool read(int sock_fd)
     {
-        if (sock_fd < 0)
-            throw runtime_error("socket failed");
-        fd_set_nonblock(sock_fd);
+        Metrics::Source &stats = Metrics::local().sources[_source];
+        char buf[2048];
+        // Only room for the credentials, the kernel discards passed fds
+        // which don't fit.
+        char control[CMSG_SPACE(sizeof(struct ucred))];
+        struct iovec iov = { buf, NELEMS(buf) - 1 };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        for (int budget = read_budget; budget > 0; budget--) {
+            msg.msg_control = control;
+            msg.msg_controllen = _limiter ? sizeof(control) : 0;
+            // MSG_TRUNC returns the full length of a datagram cut to the buffer.
+            int len = recvmsg(sock_fd, &msg, MSG_TRUNC | MSG_CMSG_CLOEXEC);
+            stats.reads.add();
+            if (len <= 0) {
+                if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    stats.eagain.add();
+                break;
+            }
+            if (len > (int)NELEMS(buf) - 1) {
+                stats.truncated.add();
+                len = NELEMS(buf) - 1;
+            }
+            if (_limiter && !allow(msg, stats))
+                continue;
+            stats.records.add();
+            stats.bytes.add(len);
+            _handler->handle(buf, len);
+        }
+        return true;
     }
 
-    ~SocketObserver() { close(sock_fd); }
-
-    void notify(ObservableInterface<int> &notification) { _reader->read(sock_fd); }
-
-    int key() const { return sock_fd; }
+    void attach(int sock_fd)
+    {
+        int on = 1;
+        if (_limiter)
+            setsockopt(sock_fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+    }
 
     private:
-    int sock_fd;
-    shared_ptr<ReaderInterface> _reader;
+    bool allow(struct msghdr &msg, Metrics::Source &stats)
+    {
+        RateLimiter::Summary summary;
+        bool allowed = _limiter->allow(sender_pid(msg), monotonic_ns(), summary);
+        if (summary.suppressed > 0) {
+            string report = RateLimiter::report(summary, _source);
+            _handler->handle(&report[0], report.size());
+        }
+        if (!allowed)
+            stats.suppressed.add();
+        return allowed;
+    }
+
+    StageRef<HandlerInterface> _handler;
+    int _source;
+    shared_ptr<RateLimiter> _limiter;
 };
 
-class StreamObserver : public ObservableInterface<int>::Observer {
+// Drains datagram sockets with recvmmsg() into a preallocated ring of
+// message slots and passes each received batch to the handler at once.
+// Payloads too large for a datagram arrive as an empty datagram carrying a
+// memfd, those are mapped copy-on-write and passed on like any other record.
+class DatagramReader : public ReaderInterface, public ReceiverInterface {
     public:
-    explicit StreamObserver(int listen_sock, shared_ptr<ReaderInterface> reader) :
-        sock_fd(unix_accept(listen_sock)),
-        _reader(reader)
+    DatagramReader(StageRef<HandlerInterface> handler, int source,
+                   int slots = 64, int slot_size = 2048,
+                   shared_ptr<RateLimiter> limiter = shared_ptr<RateLimiter>()) :
+        _handler(handler),
+        _source(source),
+        _slot_size(slot_size),
+        _limiter(limiter),
+        _ring(new char[slots * slot_size]),
+        _control(new char[slots * control_space]),
+        _msgs(slots),
+        _iov(slots),
+        // every datagram may come with a suppression report ahead of it
+        _records(slots * 2),
+        _count(0),
+        _drained(0),
+        _overflows(0),
+        _queue_limit(queue_limit())
     {
-        if (sock_fd < 0)
-            throw runtime_error("accept failed");
-        fd_set_nonblock(sock_fd);
-     }
-    ~StreamObserver() { close(sock_fd); }
-
-    void notify(ObservableInterface<int> &notification)
+        for (int i = 0; i < slots; i++) {
+            _iov[i].iov_base = &_ring[i * slot_size];
+            _iov[i].iov_len = slot_size - 1;
+            _msgs[i].msg_hdr.msg_iov = &_iov[i];
+            _msgs[i].msg_hdr.msg_iovlen = 1;
+            _msgs[i].msg_hdr.msg_control = &_control[i * control_space];
+            _msgs[i].msg_hdr.msg_controllen = control_space;
+        }
+    }
+    ~DatagramReader() {}
+    bool read(int sock_fd)
     {
-        _reader->read(sock_fd);
-        notification.delObserver(sock_fd);
+        Metrics::Source &stats = Metrics::local().sources[_source];
+        int n = 0;
+        int slots = _msgs.size();
+        for (int budget = max(read_budget, slots); budget > 0; budget -= n) {
+            int batch = min(slots, budget);
+            n = recvmmsg(sock_fd, &_msgs[0], batch, MSG_DONTWAIT | MSG_CMSG_CLOEXEC, NULL);
+            if (n <= 0)
+                break;
+            stats.reads.add();
+            for (int i = 0; i < n; i++) {
+                collect(_msgs[i].msg_hdr, _iov[i].iov_base, _msgs[i].msg_len);
+                _msgs[i].msg_hdr.msg_controllen = control_space;
+            }
+            dispatch();
+            // A short batch means the receive queue is empty, skip the
+            // recvmmsg() call that would only return EAGAIN and count the
+            // batch as that EAGAIN instead.
+            if (n < batch) {
+                stats.eagain.add();
+                break;
+            }
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            stats.reads.add();
+            stats.eagain.add();
+        }
+        drained(stats);
+        return true;
     }
 
-    int key() const { return sock_fd; }
+    size_t message_size() const { return _slot_size - 1; }
 
-    private:
-    int sock_fd;
-    shared_ptr<ReaderInterface> _reader;
-};
+    size_t control_size() const { return control_space; }
 
-class StdoutObserver : public ObservableInterface<int>::Observer {
-    public:
-    explicit StdoutObserver(shared_ptr<ReaderInterface> reader) :
-        sock_fd(unix_open(SOCK_STREAM, "/run/systemd/journal/stdout")),
-        _reader(reader)
+    void receive(struct msghdr &msg, void *buf, size_t len)
     {
-        if (sock_fd < 0)
-            throw runtime_error("socket failed");
-        listen(sock_fd, SOMAXCONN);
+        collect(msg, buf, len);
+        if (_count >= _msgs.size())
+            dispatch();
     }
 
-    ~StdoutObserver() { close(sock_fd); }
-
-    int key() const { return sock_fd; }
+    void attach(int sock_fd)
+    {
+        int on = 1;
+        if (_limiter)
+            setsockopt(sock_fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+    }
 
-    void notify(ObservableInterface<int> &notification)
+    void received()
     {
-        shared_ptr<ObservableInterface<int>::Observer> streamObserver =
-            make_shared<StreamObserver>(sock_fd, _reader);
-        notification.addObserver(streamObserver);
+        dispatch();
+        drained(Metrics::local().sources[_source]);
     }
 
     private:
-    int sock_fd;
-    shared_ptr<ReaderInterface> _reader;
-};
+    static const size_t control_space = CMSG_SPACE(sizeof(int) * 4) + CMSG_SPACE(sizeof(uint32_t)) +
+        CMSG_SPACE(sizeof(struct ucred));
+    static const size_t max_mapping = 64 * 1024 * 1024;
 
-auto main()-> int
-{
-    shared_ptr<LoggerInterface> fileLogger = make_shared<FileLogger>(fileno(stdout));
-
-    shared_ptr<HandlerInterface> syslogHandler = make_shared<SyslogHandler>(fileLogger);
-    shared_ptr<HandlerInterface> journalHandler = make_shared<JournalHandler>(fileLogger);
-    shared_ptr<HandlerInterface> streamHandler = make_shared<StreamHandler>(fileLogger);
+    void collect(struct msghdr &hdr, void *buf, size_t len)
+    {
+        Metrics::Source &stats = Metrics::local().sources[_source];
+        if (hdr.msg_flags & MSG_TRUNC)
+            stats.truncated.add();
+        if (_drained++ == 0 && _limiter)
+            _now = monotonic_ns();
+        if (_limiter && !allow(hdr, stats)) {
+            receive_control(hdr, false, stats);
+            return;
+        }
+        if (hdr.msg_controllen > 0) {
+            struct iovec payload = receive_control(hdr, len == 0, stats);
+            if (payload.iov_base != NULL) {
+                _mapped.push_back(payload);
+                buf = payload.iov_base;
+                len = payload.iov_len;
+            }
+        }
+        if (len == 0)
+            return;
+        stats.records.add();
+        stats.bytes.add(len);
+        _records[_count].iov_base = buf;
+        _records[_count].iov_len = len;
+        ++_count;
+    }
 
-    shared_ptr<ReaderInterface> syslogReader = make_shared<SocketReader>(syslogHandler);
-    shared_ptr<ReaderInterface> journalReader = make_shared<SocketReader>(journalHandler);
-    shared_ptr<ReaderInterface> streamReader = make_shared<SocketReader>(streamHandler);
+    void dispatch()
+    {
+        if (_count > 0)
+            _handler->handle(&_records[0], _count);
+        _count = 0;
+        for (auto &mapping : _mapped)
+            munmap(mapping.iov_base, mapping.iov_len);
+        _mapped.clear();
+        _reports.clear();
+    }
 
-    SocketObservable watcher;
-    try {
-        shared_ptr<SocketObservable::Observer> syslogObserver =
-            make_shared<SyslogObserver>(syslogReader);
-        watcher.addObserver(syslogObserver);
-    } catch (runtime_error &err) {
-        cerr << err.what() << endl;
+    // Every wakeup is accounted at the time of its first datagram.
+    bool allow(struct msghdr &hdr, Metrics::Source &stats)
+    {
+        RateLimiter::Summary summary;
+        bool allowed = _limiter->allow(sender_pid(hdr), _now, summary);
+        if (summary.suppressed > 0) {
+            _reports.push_back(RateLimiter::report(summary, _source));
+            _records[_count].iov_base = &_reports.back()[0];
+            _records[_count].iov_len = _reports.back().size();
+            ++_count;
+        }
+        if (!allowed)
+            stats.suppressed.add();
+        return allowed;
+    }
+
+    // Closes all passed fds. An empty datagram is a placeholder for the
+    // content of the single fd it carries, which is returned mapped.
+    // The kernel's running count of dropped datagrams is accounted as well.
+    struct iovec receive_control(struct msghdr &hdr, bool empty, Metrics::Source &stats)
+    {
+        struct iovec payload = { NULL, 0 };
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET)
+                continue;
+            if (cmsg->cmsg_type == SO_RXQ_OVFL && cmsg->cmsg_len >= CMSG_LEN(sizeof(uint32_t))) {
+                uint32_t overflows;
+                memcpy(&overflows, CMSG_DATA(cmsg), sizeof(overflows));
+                stats.dropped.add((uint32_t)(overflows - _overflows));
+                _overflows = overflows;
+                continue;
+            }
+            if (cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *fds = (int *)CMSG_DATA(cmsg);
+            struct stat st;
+            if (empty && nfds == 1 && fstat(fds[0], &st) == 0 && S_ISREG(st.st_mode) &&
+                st.st_size > 0 && (size_t)st.st_size <= max_mapping) {
+                void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fds[0], 0);
+                if (map != MAP_FAILED) {
+                    payload.iov_base = map;
+                    payload.iov_len = st.st_size;
+                }
+            }
+            for (int i = 0; i < nfds; i++)
+                close(fds[i]);
+        }
+        return payload;
+    }
+
+    // Records how deep the socket queue was when the wakeup came. A unix
+    // datagram socket queues at most net.unix.max_dgram_qlen datagrams plus
+    // one regardless of SO_RCVBUF, draining more than that in one go means
+    // the queue filled up while the reader was away.
+    void drained(Metrics::Source &stats)
+    {
+        if (_drained == 0)
+            return;
+        stats.depth.add(_drained);
+        if (_drained > _queue_limit)
+            stats.saturated.add();
+        _drained = 0;
+    }
+
+    static size_t queue_limit()
+    {
+        ifstream in("/proc/sys/net/unix/max_dgram_qlen");
+        size_t limit;
+        if (!(in >> limit))
+            limit = 10;
+        return limit + 1;
+    }
+
+    StageRef<HandlerInterface> _handler;
+    int _source;
+    size_t _slot_size;
+    shared_ptr<RateLimiter> _limiter;
+    uint64_t _now;
+    unique_ptr<char[]> _ring;
+    unique_ptr<char[]> _control;
+    vector<struct mmsghdr> _msgs;
+    vector<struct iovec> _iov;
+    vector<struct iovec> _records;
+    size_t _count;
+    size_t _drained;
+    uint32_t _overflows;
+    size_t _queue_limit;
+    vector<struct iovec> _mapped;
+    list<string> _reports;
+};
+
+// The header a native stdout stream starts with, a line each: the
+// identifier, the unit, the priority, whether lines start with a "<N>"
+// priority of their own and whether to forward them to syslog, kmsg and the
+// console, which nologd doesn't. It is parsed once per connection and kept
+// with its peer's SO_PEERCRED credentials, the prefix and fields its lines
+// are attributed with are rendered from them once. A stream whose first
+// lines aren't a valid header is taken as plain text.
+class StreamHeader {
+    public:
+    enum Line {
+        IDENTIFIER,
+        UNIT,
+        PRIORITY,
+        LEVEL_PREFIX,
+        FORWARD_TO_SYSLOG,
+        FORWARD_TO_KMSG,
+        FORWARD_TO_CONSOLE,
+        LINES
+    };
+
+    StreamHeader() :
+        _state(STATE_HEADER),
+        _cred(),
+        _level_prefix(false) {}
+
+    // Starts over for a new connection.
+    void reset(int sock_fd)
+    {
+        _state = STATE_HEADER;
+        _lines.clear();
+        _fields.clear();
+        _prefix.clear();
+        socklen_t len = sizeof(_cred);
+        if (sock_fd < 0 || getsockopt(sock_fd, SOL_SOCKET, SO_PEERCRED, &_cred, &len) < 0)
+            _cred.pid = 0;
+    }
+
+    // Lines go on to the handler once the header is complete, or once it
+    // turned out there is none.
+    bool done() const { return _state != STATE_HEADER; }
+
+    bool valid() const { return _state == STATE_VALID; }
+
+    // Takes the next line of the header, false when it shows that the stream
+    // has none. Then the lines held so far are ordinary lines.
+    bool feed(const char *line, int len)
+    {
+        if (valid_line(_lines.size(), line, len)) {
+            _lines.push_back(string(line, len));
+            if (_lines.size() == LINES)
+                parse();
+            return true;
+        }
+        _state = STATE_PLAIN;
+        return false;
+    }
+
+    const vector<string> &held() const { return _lines; }
+
+    // What the stream sent of an incomplete header, or the header it sent,
+    // for a new process taking the connection over.
+    string pending() const
+    {
+        string header;
+        if (_state != STATE_PLAIN) {
+            for (auto &line : _lines)
+                header += line + '\n';
+        }
+        return header;
+    }
+
+    // The attribution of a line, its "<N>" priority is cut off if the header
+    // said there is one.
+    RecordInfo info(char *&buf, int &len)
+    {
+        int priority = _info.priority;
+        if (_level_prefix && len >= 3 && buf[0] == '<') {
+            int value = 0;
+            int pos = 1;
+            while (pos < len && pos <= 3 && isdigit((unsigned char)buf[pos]))
+                value = value * 10 + buf[pos++] - '0';
+            if (pos > 1 && pos < len && buf[pos] == '>' && value < priorities) {
+                priority = (value & LOG_FACMASK) ? value : (priority & LOG_FACMASK) | value;
+                buf += pos + 1;
+                len -= pos + 1;
+            }
+        }
+        StringRef message = { buf, (size_t)len };
+        _fields.back().value = message;
+        RecordInfo info = _info;
+        info.priority = priority;
+        return info;
+    }
+
+    // "identifier[pid]: ", empty when the header has no identifier.
+    const string &prefix() const { return _prefix; }
+
+    private:
+    enum State {
+        STATE_HEADER,
+        STATE_VALID,
+        STATE_PLAIN
+    };
+
+    static const int priorities = LOG_NFACILITIES << 3;
+
+    // The identifier is a single word and the unit a unit name, either may
+    // be empty, so lines of text are rarely held as the start of a header.
+    static bool valid_line(size_t line, const char *buf, int len)
+    {
+        if (line == IDENTIFIER) {
+            for (int i = 0; i < len; i++) {
+                if (isspace((unsigned char)buf[i]) || iscntrl((unsigned char)buf[i]))
+                    return false;
+            }
+            return true;
+        }
+        if (line == UNIT) {
+            if (len == 0)
+                return true;
+            const char *dot = (const char *)memrchr(buf, '.', len);
+            if (len > 255 || !dot || dot == buf || dot == buf + len - 1)
+                return false;
+            for (int i = 0; i < len; i++) {
+                if (!isalnum((unsigned char)buf[i]) && (!buf[i] || !strchr(":-_.\\@", buf[i])))
+                    return false;
+            }
+            return true;
+        }
+        if (line != PRIORITY)
+            return len == 1 && (buf[0] == '0' || buf[0] == '1');
+        int value = 0;
+        for (int i = 0; i < len; i++) {
+            if (!isdigit((unsigned char)buf[i]) || i >= 4)
+                return false;
+            value = value * 10 + buf[i] - '0';
+        }
+        return len > 0 && value < priorities;
+    }
+
+    void parse()
+    {
+        _state = STATE_VALID;
+        int priority = atoi(_lines[PRIORITY].c_str());
+        if (!(priority & LOG_FACMASK))
+            priority |= LOG_USER;
+        _level_prefix = _lines[LEVEL_PREFIX] == "1";
+        const string &identifier = _lines[IDENTIFIER];
+        if (!identifier.empty())
+            _prefix = identifier + (_cred.pid > 0 ? "[" + to_string(_cred.pid) + "]: " : ": ");
+        _pid = to_string(_cred.pid);
+        _uid = to_string(_cred.uid);
+        _gid = to_string(_cred.gid);
+        add_field("SYSLOG_IDENTIFIER", identifier);
+        add_field("_SYSTEMD_UNIT", _lines[UNIT]);
+        if (_cred.pid > 0) {
+            add_field("_PID", _pid);
+            add_field("_UID", _uid);
+            add_field("_GID", _gid);
+        }
+        JournalField message = { { "MESSAGE", 7 }, { "", 0 } };
+        _fields.push_back(message);
+        _info = RecordInfo(SOURCE_STDOUT, priority, &_fields, this);
+    }
+
+    void add_field(const char *name, const string &value)
+    {
+        if (value.empty())
+            return;
+        JournalField field = { { name, strlen(name) }, { value.data(), value.size() } };
+        _fields.push_back(field);
+    }
+
+    State _state;
+    vector<string> _lines;
+    struct ucred _cred;
+    bool _level_prefix;
+    string _pid;
+    string _uid;
+    string _gid;
+    string _prefix;
+    vector<JournalField> _fields;
+    RecordInfo _info;
+};
+
+// Splits a byte stream into lines. The reassembly buffer belongs to a single
+// connection and carries a partial line over to the next read() call. Lines
+// longer than the buffer are passed on in buffer sized pieces. The buffer is
+// kept inline, a pooled connection comes in one piece with it, and so is the
+// header of the stream. A raw reader passes lines on with their newline,
+// framed like the bytes a SpliceReader passes through after them.
+class LineReader : public ReaderInterface {
+    public:
+    explicit LineReader(StageRef<HandlerInterface> handler, bool raw = false) :
+        _handler(handler),
+        _raw(raw),
+        _size(sizeof(_buf)),
+        _len(0) {}
+    ~LineReader() {}
+    bool read(int sock_fd)
+    {
+        Metrics::Source &stats = Metrics::local().sources[SOURCE_STDOUT];
+        for (;;) {
+            int len = ::read(sock_fd, &_buf[_len], _size - _len);
+            stats.reads.add();
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                stats.eagain.add();
+                return true;
+            }
+            if (len <= 0) {
+                finish();
+                return false;
+            }
+            stats.bytes.add(len);
+            char *start = &_buf[0];
+            char *scan = start + _len;
+            char *end = scan + len;
+            char *eol;
+            while ((eol = newline.find(scan, end - scan)) != NULL) {
+                line(start, eol - start, true);
+                start = scan = eol + 1;
+            }
+            _len = end - start;
+            if (_len == _size) {
+                stats.truncated.add();
+                line(start, _len, false);
+                _len = 0;
+            } else if (_len > 0 && start != &_buf[0]) {
+                memmove(&_buf[0], start, _len);
+            }
+        }
+    }
+
+    // Whether the stream is past its header, if it has one.
+    bool headed() const { return _header.done(); }
+
+    // Passes on the partial line before the rest of the stream bypasses the
+    // reader.
+    void drain()
+    {
+        if (_len > 0)
+            line(&_buf[0], _len, false);
+        _len = 0;
+    }
+
+    // Passes on what is held back for a stream that isn't read any further,
+    // the partial line and the lines held as its header. A stream ending
+    // within its header had none.
+    void finish()
+    {
+        if (_len > 0) {
+            _buf[_len] = '\n';
+            line(&_buf[0], _len, true);
+        }
+        _len = 0;
+        if (!_header.done())
+            line(NULL, -1, false);
+    }
+
+    // The header and partial line carried over to the next read().
+    string pending() const { return _header.pending() + string(_buf, _len); }
+
+    // Starts reading a connection, with what pending() returned for it.
+    void restore(int sock_fd, const string &partial)
+    {
+        _header.reset(sock_fd);
+        size_t pos = 0;
+        size_t eol;
+        while (!_header.done() && (eol = partial.find('\n', pos)) != string::npos) {
+            line((char *)&partial[pos], eol - pos, true);
+            pos = eol + 1;
+        }
+        _len = min(partial.size() - pos, (size_t)_size - 1);
+        memcpy(_buf, partial.data() + pos, _len);
+    }
+
+    private:
+    // Passes on a line, NULL once the stream ended within its header. A
+    // terminated line has its newline at buf[len].
+    void line(char *buf, int len, bool terminated)
+    {
+        if (!_header.done()) {
+            if (buf && _header.feed(buf, len))
+                return;
+            for (auto &held : _header.held()) {
+                string copy = held + '\n';
+                record(&copy[0], held.size(), true, RecordInfo());
+            }
+            if (!buf)
+                return;
+        }
+        if (_header.valid()) {
+            RecordInfo info = _header.info(buf, len);
+            record(buf, len, terminated, info);
+        } else {
+            record(buf, len, terminated, RecordInfo());
+        }
+    }
+
+    void record(char *buf, int len, bool terminated, RecordInfo info)
+    {
+        Metrics::local().sources[SOURCE_STDOUT].records.add();
+        if (_raw) {
+            len += terminated;
+            info.framed = true;
+        }
+        _handler->handle(buf, len, info);
+    }
+
+    StageRef<HandlerInterface> _handler;
+    bool _raw;
+    StreamHeader _header;
+    int _size;
+    int _len;
+    char _buf[2048];
+};
+
+// Serialises readers of several workers, see Options::ORDER_GLOBAL.
+class LockedReader : public ReaderInterface {
+    public:
+    LockedReader(StageRef<ReaderInterface> reader, shared_ptr<mutex> &lock) :
+        _reader(reader),
+        _lock(lock) {}
+    ~LockedReader() {}
+    bool read(int sock_fd)
+    {
+        lock_guard<mutex> guard(*_lock);
+        return _reader->read(sock_fd);
+    }
+    void attach(int sock_fd) { _reader->attach(sock_fd); }
+    private:
+    StageRef<ReaderInterface> _reader;
+    shared_ptr<mutex> _lock;
+};
+
+class LockedHandler : public HandlerInterface {
+    public:
+    LockedHandler(StageRef<HandlerInterface> handler, shared_ptr<mutex> &lock) :
+        _handler(handler),
+        _lock(lock) {}
+    ~LockedHandler() {}
+    void handle(char *buf, int len)
+    {
+        lock_guard<mutex> guard(*_lock);
+        _handler->handle(buf, len);
+    }
+    void handle(char *buf, int len, const RecordInfo &info)
+    {
+        lock_guard<mutex> guard(*_lock);
+        _handler->handle(buf, len, info);
+    }
+    void handle(struct iovec *records, int count)
+    {
+        lock_guard<mutex> guard(*_lock);
+        _handler->handle(records, count);
+    }
+    void expire(bool all)
+    {
+        lock_guard<mutex> guard(*_lock);
+        _handler->expire(all);
+    }
+    private:
+    StageRef<HandlerInterface> _handler;
+    shared_ptr<mutex> _lock;
+};
+
+// Moves stream data to the output fd without copying it to user memory,
+// from the socket straight into the output pipe, or through an intermediate
+// pipe for other outputs. The bytes are passed through as they are, without
+// line framing. Outputs which can't be spliced to get a read()/write() copy.
+// Splices don't block, while the output is full the reader waits for it for
+// at most full_wait_ms and leaves the rest to the next readiness event, so
+// the event loop keeps going.
+class SpliceReader : public ReaderInterface {
+    public:
+    SpliceReader(int fileno, StageRef<LoggerInterface> logger) :
+        _fileno(fileno),
+        _logger(logger),
+        _copy(false),
+        _pending(0)
+    {
+        struct stat st;
+        _direct = fstat(fileno, &st) == 0 && S_ISFIFO(st.st_mode);
+        _pipe[0] = _pipe[1] = -1;
+        if (!_direct && pipe2(_pipe, O_CLOEXEC) < 0)
+            throw runtime_error("pipe failed");
+    }
+    ~SpliceReader()
+    {
+        for (int i = 0; i < 100 && _pending > 0; i++)
+            drain();
+        if (_pipe[0] >= 0) {
+            close(_pipe[0]);
+            close(_pipe[1]);
+        }
+    }
+    bool read(int sock_fd)
+    {
+        // Records buffered by the logger precede whatever is spliced now,
+        // and so does what is left in the intermediate pipe.
+        _logger->flush();
+        if (!drain())
+            return true;
+        Metrics::Source &stats = Metrics::local().sources[SOURCE_STDOUT];
+        for (;;) {
+            ssize_t len;
+            stats.reads.add();
+            if (_copy)
+                len = copy(sock_fd, _fileno, chunk_size);
+            else
+                len = splice(sock_fd, NULL, _direct ? _fileno : _pipe[1], NULL, chunk_size,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len < 0 && errno == EINVAL && !_copy) {
+                _copy = true;
+                continue;
+            }
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // Straight into the output pipe it may be the pipe which
+                // is full rather than the socket empty.
+                if (_direct && !_copy && !writable(0))
+                    writable(full_wait_ms);
+                else
+                    stats.eagain.add();
+                return true;
+            }
+            if (len <= 0)
+                return false;
+            stats.bytes.add(len);
+            if (!_copy && !_direct) {
+                _pending = len;
+                if (!drain())
+                    return true;
+            }
+        }
+    }
+    private:
+    static const size_t chunk_size = 64 * 1024;
+    static const int full_wait_ms = 10;
+
+    bool writable(int timeout_ms)
+    {
+        struct pollfd pfd = { _fileno, POLLOUT, 0 };
+        return poll(&pfd, 1, timeout_ms) > 0;
+    }
+
+    // Moves what the intermediate pipe holds to the output, false while the
+    // output can't take all of it. What an output failing for good can't
+    // take is discarded.
+    bool drain()
+    {
+        while (_pending > 0) {
+            ssize_t moved = _copy ? copy(_pipe[0], _fileno, _pending) :
+                splice(_pipe[0], NULL, _fileno, NULL, _pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0 && errno == EINTR)
+                continue;
+            if (moved < 0 && errno == EINVAL && !_copy) {
+                _copy = true;
+                continue;
+            }
+            if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                writable(full_wait_ms);
+                return false;
+            }
+            if (moved <= 0) {
+                char buf[4096];
+                while (_pending > 0 && (moved = ::read(_pipe[0], buf, min(_pending, sizeof(buf)))) > 0)
+                    _pending -= moved;
+                _pending = 0;
+                break;
+            }
+            _pending -= moved;
+        }
+        return true;
+    }
+
+    // Writes all that is read, a copy in user memory is not left behind
+    // when the output takes only part of it or has to be waited for.
+    static ssize_t copy(int from, int to, size_t len)
+    {
+        char buf[4096];
+        ssize_t got = ::read(from, buf, min(len, sizeof(buf)));
+        for (ssize_t done = 0; got > 0 && done < got;) {
+            ssize_t written = ::write(to, buf + done, got - done);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                struct pollfd pfd = { to, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (written < 0)
+                return -1;
+            done += written;
+        }
+        return got;
+    }
+
+    int _fileno;
+    StageRef<LoggerInterface> _logger;
+    bool _direct;
+    bool _copy;
+    int _pipe[2];
+    // bytes in the intermediate pipe
+    size_t _pending;
+};
+
+// Stages of a Pipeline pass each record on to the rest of it with
+// next.write(buf, len, info), see below.
+//
+// Lines of stdout streams come attributed by the header of their connection
+// when it had one, see StreamHeader. Text lines are prefixed with what it
+// rendered, encoded records get its fields instead.
+class StreamStage {
+    public:
+    explicit StreamStage(bool prefix = true) :
+        _prefix(prefix) {}
+
+    template <class Next>
+    void write(Next &next, char *buf, int len, const RecordInfo &info)
+    {
+        if (!info.stream) {
+            RecordInfo plain(SOURCE_STDOUT, LOG_USER | LOG_INFO);
+            plain.framed = info.framed;
+            next.write(buf, len, plain);
+            return;
+        }
+        const string &prefix = info.stream->prefix();
+        if (!_prefix || prefix.empty()) {
+            next.write(buf, len, info);
+            return;
+        }
+        size_t size = prefix.size() + len;
+        if (_buf.size() < size)
+            _buf.resize(size);
+        memcpy(&_buf[0], prefix.data(), prefix.size());
+        memcpy(&_buf[prefix.size()], buf, len);
+        next.write(&_buf[0], size, info);
+    }
+
+    private:
+    bool _prefix;
+    vector<char> _buf;
+};
+
+// Drops syslog records by facility, severity and identifier. A rule
+// "facility.severity[:identifier]" matches records of the given severity or
+// a less important one, "*" matches any facility or severity.
+class SyslogFilter {
+    public:
+    struct Rule {
+        string selector;
+        int facility;
+        int severity;
+        string identifier;
+        unsigned long hits;
+    };
+
+    SyslogFilter() :
+        _identifiers(false) {}
+
+    void add(const string &selector)
+    {
+        Rule rule = { selector, -1, 0, "", 0 };
+        size_t dot = selector.find('.');
+        size_t colon = selector.find(':');
+        if (dot == string::npos || dot > colon)
+            throw runtime_error("invalid filter rule " + selector);
+        string facility = selector.substr(0, dot);
+        string severity = selector.substr(dot + 1, colon == string::npos ? colon : colon - dot - 1);
+        if (facility != "*" && (rule.facility = lookup(facility, facilities, NELEMS(facilities))) < 0)
+            throw runtime_error("unknown facility " + facility);
+        if (severity != "*" && (rule.severity = lookup(severity, severities, NELEMS(severities))) < 0)
+            throw runtime_error("unknown severity " + severity);
+        if (colon != string::npos)
+            rule.identifier = selector.substr(colon + 1);
+        _identifiers = _identifiers || !rule.identifier.empty();
+        _rules.push_back(rule);
+    }
+
+    bool empty() const { return _rules.empty(); }
+
+    const vector<Rule> &rules() const { return _rules; }
+
+    // NULL for codes without a name
+    static const char *const facilities[24];
+    static const char *const severities[8];
+
+    // Takes the decoded priority and the message following it.
+    bool drop(int priority, const char *msg, int len)
+    {
+        int facility = LOG_FAC(priority);
+        int severity = LOG_PRI(priority);
+        StringRef identifier = { NULL, 0 };
+        if (_identifiers)
+            identifier = syslog_identifier(msg, len);
+        for (auto &rule : _rules) {
+            if (rule.facility >= 0 && rule.facility != facility)
+                continue;
+            if (severity < rule.severity)
+                continue;
+            if (!rule.identifier.empty() && (rule.identifier.size() != identifier.len ||
+                memcmp(rule.identifier.data(), identifier.data, identifier.len)))
+                continue;
+            ++rule.hits;
+            return true;
+        }
+        return false;
+    }
+
+    private:
+    static int lookup(const string &name, const char *const *names, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+            if (names[i] && name == names[i])
+                return i;
+        return -1;
+    }
+
+    // Locates the tag in "Mmm dd hh:mm:ss tag[pid]: message" as sent by
+    // syslog(3), the timestamp is optional.
+    static StringRef syslog_identifier(const char *msg, int len)
+    {
+        int pos = 0;
+        if (len > 16 && msg[3] == ' ' && msg[6] == ' ' && msg[9] == ':' &&
+            msg[12] == ':' && msg[15] == ' ')
+            pos = 16;
+        int start = pos;
+        while (pos < len && msg[pos] != '[' && msg[pos] != ':' && msg[pos] != ' ')
+            ++pos;
+        StringRef identifier = { msg + start, (size_t)(pos - start) };
+        return identifier;
+    }
+
+    vector<Rule> _rules;
+    bool _identifiers;
+};
+
+const char *const SyslogFilter::facilities[24] = {
+    "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news",
+    "uucp", "cron", "authpriv", "ftp", NULL, NULL, NULL, NULL,
+    "local0", "local1", "local2", "local3", "local4", "local5", "local6", "local7"
+};
+
+const char *const SyslogFilter::severities[8] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+struct SyslogStage {
+    template <class Next>
+    void write(Next &next, char *buf, int len, const RecordInfo &)
+    {
+        int start = 0;
+        int end = len - 1;
+        // Strip numerically coded log level and facility, they are only used
+        // to filter the record. A prefix of more than 3 digits or above 191
+        // isn't one (RFC 3164, 5424), it stays in the text.
+        int priority = LOG_USER | LOG_NOTICE;
+        if (len > 0 && buf[0] == '<') {
+            int value = 0;
+            int pos = 1;
+            while (pos < len && pos <= 3 && isdigit((unsigned char)buf[pos]))
+                value = value * 10 + buf[pos++] - '0';
+            if (pos > 1 && pos < len && buf[pos] == '>' && value <= 191) {
+                start = pos + 1;
+                priority = value;
+            }
+        }
+        // Only the trailing newlines are stripped, a handful of bytes at
+        // most, which is not worth a vector kernel.
+        while (end >= start && buf[end] == '\n')
+            buf[end--] = '\0';
+        next.write(buf + start, end + 1 - start, RecordInfo(SOURCE_SYSLOG, priority));
+    }
+};
+
+// Drops the syslog records matched by the filter, if there is one.
+class FilterStage {
+    public:
+    explicit FilterStage(shared_ptr<SyslogFilter> filter = nullptr) :
+        _filter(filter) {}
+
+    template <class Next>
+    void write(Next &next, char *buf, int len, const RecordInfo &info)
+    {
+        if (_filter && _filter->drop(info.priority, buf, len))
+            return;
+        next.write(buf, len, info);
+    }
+
+    private:
+    shared_ptr<SyslogFilter> _filter;
+};
+
+// Parses the native journal protocol: a sequence of "KEY=value\n" fields,
+// or "KEY\n" followed by a little endian 64 bit length, the binary value and
+// a newline. Fields reference the parsed buffer, the array is reused.
+class JournalParser {
+    public:
+    bool parse(char *buf, size_t len)
+    {
+        _fields.clear();
+        char *pos = buf;
+        char *end = buf + len;
+        while (pos < end) {
+            char *eol = newline.find(pos, end - pos);
+            if (eol == pos) {
+                ++pos;
+                continue;
+            }
+            char *eq = (char *)memchr(pos, '=', (eol ? eol : end) - pos);
+            JournalField field;
+            if (eq != NULL) {
+                char *value_end = eol ? eol : end;
+                field.name = { pos, (size_t)(eq - pos) };
+                field.value = { eq + 1, (size_t)(value_end - eq - 1) };
+                pos = value_end + 1;
+            } else {
+                uint64_t size;
+                if (eol == NULL || (size_t)(end - eol - 1) < sizeof(size))
+                    return false;
+                memcpy(&size, eol + 1, sizeof(size));
+                size = le64toh(size);
+                char *value = eol + 1 + sizeof(size);
+                if (size > (uint64_t)(end - value))
+                    return false;
+                field.name = { pos, (size_t)(eol - pos) };
+                field.value = { value, (size_t)size };
+                pos = value + size + 1;
+            }
+            _fields.push_back(field);
+        }
+        return true;
+    }
+
+    const StringRef *find(const char *name) const
+    {
+        for (auto &field : _fields)
+            if (field.name == name)
+                return &field.value;
+        return NULL;
+    }
+
+    const vector<JournalField> &fields() const { return _fields; }
+
+    private:
+    vector<JournalField> _fields;
+};
+
+// Passes on the MESSAGE of journal entries together with all their fields.
+// Text lines can't hold newlines, they are flattened to spaces unless the
+// records are encoded, see EncodeStage.
+class JournalStage {
+    public:
+    explicit JournalStage(bool flatten = true) :
+        _flatten(flatten) {}
+
+    template <class Next>
+    void write(Next &next, char *buf, int len, const RecordInfo &)
+    {
+        const StringRef *message = NULL;
+        if (_parser.parse(buf, len))
+            message = _parser.find("MESSAGE");
+        if (message == NULL) {
+            // Not a journal entry, print the whole datagram.
+            if (_flatten)
+                newline.replace(buf, len, ' ');
+            next.write(buf, len, RecordInfo(SOURCE_JOURNAL));
+            return;
+        }
+        if (_flatten)
+            newline.replace((char *)message->data, message->len, ' ');
+        next.write((char *)message->data, message->len, RecordInfo(SOURCE_JOURNAL, priority(), &_parser.fields()));
+    }
+    private:
+    // Same defaults as journald, user facility and info severity.
+    int priority() const
+    {
+        int severity = LOG_INFO;
+        int facility = LOG_FAC(LOG_USER);
+        const StringRef *value = _parser.find("PRIORITY");
+        if (value && value->len == 1 && value->data[0] >= '0' && value->data[0] <= '7')
+            severity = value->data[0] - '0';
+        value = _parser.find("SYSLOG_FACILITY");
+        if (value && value->len > 0 && value->len < 3 && isdigit(value->data[0])) {
+            facility = value->data[0] - '0';
+            if (value->len == 2)
+                facility = isdigit(value->data[1]) ? facility * 10 + value->data[1] - '0' : LOG_NFACILITIES;
+            if (facility >= LOG_NFACILITIES)
+                facility = LOG_FAC(LOG_USER);
+        }
+        return LOG_MAKEPRI(facility << 3, severity);
+    }
+
+    bool _flatten;
+    JournalParser _parser;
+};
+
+// Collapses repeated records. A record with the source, priority, payload
+// and fields of one of the last `records` distinct records is counted
+// instead of passed on; window_ns after the first of them, or when its entry
+// is taken over by another record, a "message repeated N times: [payload]"
+// record with the same fields is passed on in place of the repeats. A window
+// of one record collapses consecutive repeats only. Records are compared by
+// a hash first, stored copies of the payloads rule out collisions.
+class DedupStage {
+    public:
+    explicit DedupStage(size_t records = 0, uint64_t window_ns = 0) :
+        _window_ns(window_ns),
+        _entries(records),
+        _next(0) {}
+
+    template <class Next>
+    void write(Next &next, char *buf, int len, const RecordInfo &info)
+    {
+        if (_entries.empty()) {
+            next.write(buf, len, info);
+            return;
+        }
+        uint64_t now = WallClock::ticks();
+        attribute(info);
+        uint64_t hash = hash_bytes(buf, len, (uint64_t)info.source << 32 | (uint32_t)info.priority);
+        hash = hash_bytes(_attribution.data(), _attribution.size(), hash);
+        for (auto &entry : _entries) {
+            if (entry.hash != hash || entry.source != info.source || entry.priority != info.priority ||
+                entry.payload.size() != (size_t)len || memcmp(entry.payload.data(), buf, len) ||
+                entry.attribution != _attribution)
+                continue;
+            if (now - entry.since < _window_ns) {
+                entry.repeats++;
+                Metrics::local().sources[info.source].repeated.add();
+                return;
+            }
+            report(next, entry);
+            entry.since = now;
+            next.write(buf, len, info);
+            return;
+        }
+        Entry &entry = _entries[_next];
+        _next = (_next + 1) % _entries.size();
+        report(next, entry);
+        entry.hash = hash;
+        entry.source = info.source;
+        entry.priority = info.priority;
+        entry.payload.assign(buf, len);
+        entry.attribution = _attribution;
+        entry.since = now;
+        next.write(buf, len, info);
+    }
+
+    // Reports the repeats whose window has passed, run from a loop hook, or
+    // all repeats counted so far.
+    template <class Next>
+    void expire(Next &next, bool all)
+    {
+        uint64_t now = WallClock::ticks();
+        for (auto &entry : _entries) {
+            if (entry.repeats > 0 && (all || now - entry.since >= _window_ns)) {
+                report(next, entry);
+                entry.since = now;
+            }
+        }
+    }
+
+    private:
+    struct Entry {
+        Entry() :
+            hash(0),
+            source(SOURCE_NONE),
+            priority(-1),
+            since(0),
+            repeats(0) {}
+
+        uint64_t hash;
+        int source;
+        int priority;
+        string payload;
+        // the fields of the record, see attribute()
+        string attribution;
+        // the monotonic time of the wakeup, see WallClock::ticks()
+        uint64_t since;
+        unsigned repeats;
+    };
+
+    // The fields of a record as name and value lengths (u32) each followed
+    // by the bytes, so records of different senders differ even when their
+    // payload doesn't. The MESSAGE is the payload, its value length is
+    // marked ~0 to put the report in its place.
+    void attribute(const RecordInfo &info)
+    {
+        _attribution.clear();
+        if (!info.fields)
+            return;
+        for (auto &field : *info.fields) {
+            bool message = field.name == "MESSAGE";
+            append_length(field.name.len);
+            _attribution.append(field.name.data, field.name.len);
+            append_length(message ? ~(uint32_t)0 : field.value.len);
+            if (!message)
+                _attribution.append(field.value.data, field.value.len);
+        }
+    }
+
+    void append_length(uint32_t len) { _attribution.append((const char *)&len, sizeof(len)); }
+
+    // Multiplicative hash over 8 byte words.
+    static uint64_t hash_bytes(const char *buf, size_t len, uint64_t seed)
+    {
+        uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+        size_t pos = 0;
+        for (; pos + 8 <= len; pos += 8) {
+            uint64_t word;
+            memcpy(&word, buf + pos, sizeof(word));
+            h = (h ^ word) * 0xff51afd7ed558ccdULL;
+            h ^= h >> 32;
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, buf + pos, len - pos);
+        h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+        return h ^ (h >> 29);
+    }
+
+    template <class Next>
+    void report(Next &next, Entry &entry)
+    {
+        if (entry.repeats == 0)
+            return;
+        _report = "message repeated " + to_string(entry.repeats) + " times: [" + entry.payload + "]";
+        entry.repeats = 0;
+        if (entry.attribution.empty()) {
+            next.write(&_report[0], _report.size(), RecordInfo(entry.source, entry.priority));
+            return;
+        }
+        // The report carries the fields of the record it stands for.
+        _fields.clear();
+        const char *pos = entry.attribution.data();
+        const char *end = pos + entry.attribution.size();
+        while (pos < end) {
+            uint32_t name_len, value_len;
+            memcpy(&name_len, pos, sizeof(name_len));
+            JournalField field = { { pos + sizeof(name_len), name_len }, { NULL, 0 } };
+            pos += sizeof(name_len) + name_len;
+            memcpy(&value_len, pos, sizeof(value_len));
+            pos += sizeof(value_len);
+            if (value_len == ~(uint32_t)0) {
+                field.value.data = _report.data();
+                field.value.len = _report.size();
+            } else {
+                field.value.data = pos;
+                field.value.len = value_len;
+                pos += value_len;
+            }
+            _fields.push_back(field);
+        }
+        next.write(&_report[0], _report.size(), RecordInfo(entry.source, entry.priority, &_fields));
+    }
+
+    uint64_t _window_ns;
+    vector<Entry> _entries;
+    size_t _next;
+    string _report;
+    string _attribution;
+    vector<JournalField> _fields;
+};
+
+// Prefixes records with the time of the wakeup, their source and priority,
+// e.g. "2026-10-14T12:00:00.123+0200 syslog daemon.info: ". The time is
+// rendered once a second with only the milliseconds patched in per record,
+// the source and priority part once per combination, so a record costs the
+// copies into the output buffer.
+class FormatStage {
+    public:
+    FormatStage() :
+        _second(-1),
+        _stamp(),
+        _stamp_len(0),
+        _prefixes((SOURCE_STDOUT + 1) * (priorities + 1)) {}
+
+    template <class Next>
+    void write(Next &next, char *buf, int len, const RecordInfo &info)
+    {
+        const struct timespec &now = WallClock::now();
+        if (now.tv_sec != _second)
+            render_time(now.tv_sec);
+        int ms = now.tv_nsec / 1000000;
+        _stamp[20] = '0' + ms / 100;
+        _stamp[21] = '0' + ms / 10 % 10;
+        _stamp[22] = '0' + ms % 10;
+        const string &prefix = this->prefix(info);
+        size_t size = _stamp_len + prefix.size() + len;
+        if (_buf.size() < size)
+            _buf.resize(size);
+        memcpy(&_buf[0], _stamp, _stamp_len);
+        memcpy(&_buf[_stamp_len], prefix.data(), prefix.size());
+        memcpy(&_buf[_stamp_len + prefix.size()], buf, len);
+        next.write(&_buf[0], size, info);
+    }
+
+    private:
+    static const int priorities = LOG_NFACILITIES << 3;
+
+    void render_time(time_t second)
+    {
+        struct tm tm;
+        localtime_r(&second, &tm);
+        char date[20], zone[8];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+        strftime(zone, sizeof(zone), "%z", &tm);
+        _stamp_len = snprintf(_stamp, sizeof(_stamp), "%s.000%s ", date, zone);
+        _second = second;
+    }
+
+    const string &prefix(const RecordInfo &info)
+    {
+        static const char *const source_names[] = { "-", "syslog", "journal", "stdout" };
+        int priority = info.priority >= 0 && info.priority < priorities ? info.priority : -1;
+        string &prefix = _prefixes[info.source * (priorities + 1) + priority + 1];
+        if (!prefix.empty())
+            return prefix;
+        prefix = source_names[info.source];
+        if (priority >= 0) {
+            const char *facility = SyslogFilter::facilities[LOG_FAC(priority)];
+            prefix += ' ';
+            prefix += facility ? facility : to_string(LOG_FAC(priority));
+            prefix += '.';
+            prefix += SyslogFilter::severities[LOG_PRI(priority)];
+        }
+        prefix += ": ";
+        return prefix;
+    }
+
+    time_t _second;
+    char _stamp[40];
+    size_t _stamp_len;
+    vector<string> _prefixes;
+    vector<char> _buf;
+};
+
+// Encodings of the output beside plain text lines.
+enum Output {
+    OUTPUT_TEXT,
+    // text lines prefixed by a FormatStage
+    OUTPUT_FORMAT,
+    OUTPUT_JSON,
+    OUTPUT_BINARY
+};
+
+// Encodes records as JSON lines or as length prefixed binary records. Both
+// keep the priority of syslog records and all fields of journal entries,
+// values with newlines and binary values included, so nothing is lost to
+// the flattening done for text lines. The JSON object of a record is e.g.
+// {"timestamp":USEC,"source":"syslog","priority":30,"facility":"daemon",
+// "severity":"info","MESSAGE":"..."}, a journal entry has a member per field
+// instead of MESSAGE. The source and priority part is rendered once per
+// combination, strings are copied up to the next byte to escape, found by
+// a vector kernel. A value which isn't valid UTF-8 becomes an array of its
+// bytes, as in journalctl's JSON output. A binary record is, little endian: the size of the rest
+// of the record (u32), the timestamp (u64), source (u8), priority (u8, 0xff
+// when unknown) and field count (u16), followed by the fields, each its
+// name length (u16), value length (u32), name and value.
+class EncodeStage {
+    public:
+    explicit EncodeStage(bool binary = false) :
+        _binary(binary),
+        _prefixes((SOURCE_STDOUT + 1) * (priorities + 1)) {}
+
+    template <class Next>
+    void write(Next &next, char *buf, int len, const RecordInfo &info)
+    {
+        const struct timespec &now = WallClock::now();
+        uint64_t timestamp = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+        _out.clear();
+        if (_binary)
+            encode_binary(timestamp, buf, len, info);
+        else
+            encode_json(timestamp, buf, len, info);
+        RecordInfo encoded(info.source, info.priority);
+        encoded.framed = true;
+        next.write(&_out[0], _out.size(), encoded);
+    }
+
+    private:
+    static const int priorities = LOG_NFACILITIES << 3;
+
+    void encode_json(uint64_t timestamp, const char *buf, int len, const RecordInfo &info)
+    {
+        _out.append("{\"timestamp\":");
+        append_number(timestamp);
+        _out.append(prefix(info));
+        if (info.fields) {
+            bool first = true;
+            for (auto &field : *info.fields) {
+                if (!first)
+                    _out.push_back(',');
+                first = false;
+                append_string(field.name.data, field.name.len);
+                _out.push_back(':');
+                append_string(field.value.data, field.value.len);
+            }
+        } else {
+            _out.append("\"MESSAGE\":");
+            append_string(buf, len);
+        }
+        _out.append("}\n");
+    }
+
+    void append_number(uint64_t n)
+    {
+        char digits[20];
+        int pos = sizeof(digits);
+        do {
+            digits[--pos] = '0' + n % 10;
+            n /= 10;
+        } while (n > 0);
+        _out.append(digits + pos, sizeof(digits) - pos);
+    }
+
+    void append_string(const char *data, size_t len)
+    {
+        static const char hex[] = "0123456789abcdef";
+        const char *begin = data;
+        const char *end = data + len;
+        size_t start = _out.size();
+        _out.push_back('"');
+        for (;;) {
+            const char *special = find_json_escape(data, end - data);
+            _out.append(data, special - data);
+            if (special == end)
+                break;
+            unsigned char c = *special;
+            if (c >= 0x80) {
+                size_t sequence = utf8_length(special, end);
+                if (sequence == 0) {
+                    _out.resize(start);
+                    append_bytes(begin, len);
+                    return;
+                }
+                _out.append(special, sequence);
+                data = special + sequence;
+                continue;
+            }
+            char escape = json_escapes.table[c];
+            _out.push_back('\\');
+            _out.push_back(escape);
+            if (escape == 'u') {
+                const char code[4] = { '0', '0', hex[c >> 4], hex[c & 15] };
+                _out.append(code, sizeof(code));
+            }
+            data = special + 1;
+        }
+        _out.push_back('"');
+    }
+
+    void append_bytes(const char *data, size_t len)
+    {
+        _out.push_back('[');
+        for (size_t i = 0; i < len; i++) {
+            if (i > 0)
+                _out.push_back(',');
+            append_number((unsigned char)data[i]);
+        }
+        _out.push_back(']');
+    }
+
+    // Length of the well-formed UTF-8 sequence at pos, 0 if there is none:
+    // no overlong forms, surrogates or code points beyond U+10FFFF.
+    static size_t utf8_length(const char *pos, const char *end)
+    {
+        const unsigned char *s = (const unsigned char *)pos;
+        size_t avail = end - pos;
+        unsigned char low = 0x80, high = 0xbf;
+        size_t len;
+        if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+            len = 2;
+        } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+            len = 3;
+            if (s[0] == 0xe0)
+                low = 0xa0;
+            else if (s[0] == 0xed)
+                high = 0x9f;
+        } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+            len = 4;
+            if (s[0] == 0xf0)
+                low = 0x90;
+            else if (s[0] == 0xf4)
+                high = 0x8f;
+        } else {
+            return 0;
+        }
+        if (avail < len || s[1] < low || s[1] > high)
+            return 0;
+        for (size_t i = 2; i < len; i++)
+            if ((s[i] & 0xc0) != 0x80)
+                return 0;
+        return len;
+    }
+
+    // ,"source":"syslog","priority":30,"facility":"daemon","severity":"info",
+    const string &prefix(const RecordInfo &info)
+    {
+        static const char *const source_names[] = { "-", "syslog", "journal", "stdout" };
+        int priority = info.priority >= 0 && info.priority < priorities ? info.priority : -1;
+        string &prefix = _prefixes[info.source * (priorities + 1) + priority + 1];
+        if (!prefix.empty())
+            return prefix;
+        prefix = string(",\"source\":\"") + source_names[info.source] + "\",";
+        if (priority >= 0) {
+            const char *facility = SyslogFilter::facilities[LOG_FAC(priority)];
+            prefix += "\"priority\":" + to_string(priority) + ",\"facility\":\"";
+            prefix += facility ? facility : to_string(LOG_FAC(priority));
+            prefix += string("\",\"severity\":\"") + SyslogFilter::severities[LOG_PRI(priority)] + "\",";
+        }
+        return prefix;
+    }
+
+    void encode_binary(uint64_t timestamp, const char *buf, int len, const RecordInfo &info)
+    {
+        static const size_t header_size = 16;
+        _out.resize(header_size);
+        unsigned count = 0;
+        if (info.fields) {
+            for (auto &field : *info.fields) {
+                if (count == UINT16_MAX)
+                    break;
+                append_field(field.name.data, field.name.len, field.value.data, field.value.len);
+                count++;
+            }
+        } else {
+            append_field("MESSAGE", 7, buf, len);
+            count = 1;
+        }
+        char *header = &_out[0];
+        put(header, (uint32_t)htole32(_out.size() - 4));
+        put(header + 4, (uint64_t)htole64(timestamp));
+        header[12] = info.source;
+        header[13] = info.priority >= 0 && info.priority < priorities ? info.priority : 0xff;
+        put(header + 14, (uint16_t)htole16(count));
+    }
+
+    void append_field(const char *name, size_t name_len, const char *value, size_t value_len)
+    {
+        char lengths[6];
+        put(lengths, (uint16_t)htole16(name_len));
+        put(lengths + 2, (uint32_t)htole32(value_len));
+        _out.append(lengths, sizeof(lengths));
+        _out.append(name, name_len);
+        _out.append(value, value_len);
+    }
+
+    template <class T>
+    static void put(char *pos, T value) { memcpy(pos, &value, sizeof(value)); }
+
+    bool _binary;
+    vector<string> _prefixes;
+    string _out;
+};
+
+template <class... Stages>
+class Pipeline;
+
+// Chain of stages composed at compile time, each one a member of the
+// pipeline before it, ending in a logger of type Sink. With a concrete
+// (final) logger type the whole per-record path from the first stage to
+// the logger can be inlined, with LoggerInterface the logger is picked at
+// runtime.
+template <class Sink>
+class Pipeline<Sink> {
+    public:
+    explicit Pipeline(StageRef<Sink> sink) :
+        _sink(sink) {}
+
+    void write(char *buf, int len, const RecordInfo &info) { _sink->write(buf, len, info); }
+
+    void expire(bool) {}
+
+    private:
+    StageRef<Sink> _sink;
+};
+
+template <class Stage, class... Rest>
+class Pipeline<Stage, Rest...> {
+    public:
+    template <class... Args>
+    explicit Pipeline(const Stage &stage, Args&&... rest) :
+        _stage(stage),
+        _rest(forward<Args>(rest)...) {}
+
+    void write(char *buf, int len, const RecordInfo &info) { _stage.write(_rest, buf, len, info); }
+
+    // Calls expire() of the stages which have one.
+    void expire(bool all)
+    {
+        expire(_stage, 0, all);
+        _rest.expire(all);
+    }
+
+    private:
+    template <class S>
+    auto expire(S &stage, int, bool all) -> decltype(stage.expire(declval<Pipeline<Rest...> &>(), all))
+    {
+        stage.expire(_rest, all);
+    }
+
+    template <class S>
+    void expire(S &, long, bool) {}
+
+    Stage _stage;
+    Pipeline<Rest...> _rest;
+};
+
+// Plugs a pipeline into a chain assembled at runtime, readers pay one virtual
+// call per batch of records.
+template <class... Stages>
+class PipelineHandler : public HandlerInterface {
+    public:
+    template <class... Args>
+    explicit PipelineHandler(Args&&... args) :
+        _pipeline(forward<Args>(args)...) {}
+
+    void handle(char *buf, int len) { _pipeline.write(buf, len, RecordInfo()); }
+
+    void handle(char *buf, int len, const RecordInfo &info) { _pipeline.write(buf, len, info); }
+
+    void handle(struct iovec *records, int count)
+    {
+        for (int i = 0; i < count; i++)
+            _pipeline.write((char *)records[i].iov_base, records[i].iov_len, RecordInfo());
+    }
+
+    void expire(bool all) { _pipeline.expire(all); }
+
+    private:
+    Pipeline<Stages...> _pipeline;
+};
+
+class FileLogger final : public LoggerInterface {
+    public:
+    explicit FileLogger(int fileno) :
+        _fileno(fileno) {}
+    ~FileLogger() {}
+    void write(const char *buf, int len) { write(buf, len, RecordInfo()); }
+    // Final, so pipelines ending here call the logger directly. A single
+    // writev() keeps records intact when several workers share the output
+    // fd.
+    void write(const char *buf, int len, const RecordInfo &info)
+    {
+        struct iovec iov[2] = { { (void *)"\n", 1 }, { (void *)buf, (size_t)len } };
+        int first = info.framed ? 1 : 0;
+        Metrics &metrics = Metrics::local();
+        uint64_t start = monotonic_ns();
+        ::writev(_fileno, iov + first, NELEMS(iov) - first);
+        metrics.writes.add();
+        metrics.write.add(monotonic_ns() - start);
+    }
+    private:
+    int _fileno;
+};
+
+// Coalesces records into a list of fixed size chunks which are written out
+// with writev() on flush(), when more than max_bytes are pending or when the
+// oldest pending record is older than max_delay milliseconds. Loggers of
+// several workers sharing the output fd write whole records of up to
+// PIPE_BUF bytes at a time, a pipe doesn't interleave those.
+class BufferedLogger final : public LoggerInterface {
+    public:
+    explicit BufferedLogger(int fileno, size_t max_bytes = 256 * 1024, int max_delay = 100, bool shared = false) :
+        _fileno(fileno),
+        _max_bytes(max_bytes),
+        _max_delay(max_delay),
+        _shared(shared),
+        _pending(0),
+        _since(0) {}
+    // A non-blocking output still gets what is buffered, unless it takes
+    // nothing for a second.
+    ~BufferedLogger()
+    {
+        flush();
+        struct pollfd pfd = { _fileno, POLLOUT, 0 };
+        while (!_iov.empty() && poll(&pfd, 1, 1000) > 0)
+            flush();
+    }
+    void write(const char *buf, int len) { write(buf, len, RecordInfo()); }
+    void write(const char *buf, int len, const RecordInfo &info)
+    {
+        if (_pending == 0)
+            _since = now();
+        if (!info.framed)
+            append("\n", 1);
+        append(buf, len);
+        if (_shared)
+            _records.push_back(_pending);
+        if (_pending >= _max_bytes || now() - _since >= _max_delay)
+            flush();
+    }
+    // What a non-blocking output can't take for now is kept for the next
+    // flush, up to max_backlog bytes. Beyond that, and after other errors,
+    // the buffered bytes are dropped and counted.
+    void flush()
+    {
+        Metrics &metrics = Metrics::local();
+        size_t first = 0;
+        size_t done = 0;
+        size_t record = 0;
+        while (first < _iov.size()) {
+            size_t limit = SIZE_MAX;
+            if (_shared) {
+                while (_records[record] <= done)
+                    record++;
+                while (record + 1 < _records.size() && _records[record + 1] - done <= PIPE_BUF)
+                    record++;
+                limit = _records[record] - done;
+            }
+            int count = 0;
+            size_t bytes = 0;
+            while (first + count < _iov.size() && count < IOV_MAX && bytes < limit)
+                bytes += _iov[first + count++].iov_len;
+            // The last chunk may hold more than the records written.
+            struct iovec &last = _iov[first + count - 1];
+            size_t over = bytes > limit ? bytes - limit : 0;
+            last.iov_len -= over;
+            uint64_t start = monotonic_ns();
+            ssize_t written = ::writev(_fileno, &_iov[first], count);
+            last.iov_len += over;
+            metrics.writes.add();
+            metrics.write.add(monotonic_ns() - start);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && _pending <= max_backlog)
+                    break;
+                metrics.write_dropped.add(_pending);
+                first = _iov.size();
+                _pending = 0;
+                break;
+            }
+            _pending -= written;
+            done += written;
+            while (written > 0 && (size_t)written >= _iov[first].iov_len)
+                written -= _iov[first++].iov_len;
+            if (written > 0) {
+                _iov[first].iov_base = (char *)_iov[first].iov_base + written;
+                _iov[first].iov_len -= written;
+            }
+        }
+        // The chunks written go to the back for reuse, the rest moves to
+        // the front, so only the last chunk is filled up by append().
+        rotate(_chunks.begin(), _chunks.begin() + first, _chunks.end());
+        _iov.erase(_iov.begin(), _iov.begin() + first);
+        if (!_iov.empty() && _iov[0].iov_base != _chunks[0].get()) {
+            memmove(_chunks[0].get(), _iov[0].iov_base, _iov[0].iov_len);
+            _iov[0].iov_base = _chunks[0].get();
+        }
+        if (_iov.empty())
+            _pending = 0;
+        // Record ends are kept relative to what is left.
+        size_t kept = 0;
+        for (size_t i = 0; i < _records.size() && _pending > 0; i++) {
+            if (_records[i] > done)
+                _records[kept++] = _records[i] - done;
+        }
+        _records.resize(kept);
+    }
+    private:
+    static const size_t chunk_size = 64 * 1024;
+    static const size_t max_backlog = 16 * 1024 * 1024;
+
+    static long now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    void append(const char *buf, size_t len)
+    {
+        while (len > 0) {
+            size_t used = _iov.empty() ? chunk_size : _iov.back().iov_len;
+            if (used == chunk_size) {
+                if (_chunks.size() == _iov.size())
+                    _chunks.emplace_back(new char[chunk_size]);
+                struct iovec iov = { _chunks[_iov.size()].get(), 0 };
+                _iov.push_back(iov);
+                used = 0;
+            }
+            size_t n = min(len, chunk_size - used);
+            memcpy((char *)_iov.back().iov_base + _iov.back().iov_len, buf, n);
+            _iov.back().iov_len += n;
+            _pending += n;
+            buf += n;
+            len -= n;
+        }
+    }
+
+    int _fileno;
+    size_t _max_bytes;
+    long _max_delay;
+    bool _shared;
+    size_t _pending;
+    long _since;
+    vector<unique_ptr<char[]>> _chunks;
+    vector<struct iovec> _iov;
+    // with _shared, where each pending record ends
+    vector<size_t> _records;
+};
+
+// Decouples the output from the event loops: records are copied into a
+// bounded lock-free ring (D. Vyukov's bounded MPMC queue with a single
+// consumer) and written to the wrapped logger by a dedicated thread. When
+// the ring is full producers wait, which is counted as backpressure.
+// Records longer than a slot are copied to the heap instead, so they pass
+// whole, encoded records keep their framing.
+class QueueLogger final : public LoggerInterface {
+    public:
+    explicit QueueLogger(shared_ptr<LoggerInterface> logger, size_t slots = 4096, int slot_size = 2048) :
+        _logger(logger),
+        _mask(ring_size(slots) - 1),
+        _slot_size(slot_size),
+        _slots(new Slot[_mask + 1]),
+        _data(new char[(_mask + 1) * slot_size]),
+        _head(0),
+        _stopped(false),
+        _sleeping(false),
+        _full(0),
+        _overflows(0)
+    {
+        for (size_t i = 0; i <= _mask; i++) {
+            _slots[i].seq.store(i, memory_order_relaxed);
+            _slots[i].overflow = NULL;
+        }
+        _writer = thread(&QueueLogger::run, this);
+    }
+
+    // Producers must be done by now, whatever is queued is still written.
+    ~QueueLogger()
+    {
+        _stopped.store(true);
+        wake();
+        _writer.join();
+    }
+
+    void write(const char *buf, int len) { write(buf, len, RecordInfo()); }
+
+    void write(const char *buf, int len, const RecordInfo &info)
+    {
+        char *overflow = NULL;
+        if (len > _slot_size) {
+            overflow = new char[len];
+            memcpy(overflow, buf, len);
+            _overflows.fetch_add(1, memory_order_relaxed);
+        }
+        bool full = false;
+        size_t pos = _head.load(memory_order_relaxed);
+        for (;;) {
+            size_t seq = _slots[pos & _mask].seq.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (_head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            } else {
+                if (diff < 0) {
+                    if (!full)
+                        _full.fetch_add(1, memory_order_relaxed);
+                    full = true;
+                    this_thread::yield();
+                }
+                pos = _head.load(memory_order_relaxed);
+            }
+        }
+        Slot &slot = _slots[pos & _mask];
+        if (!overflow)
+            memcpy(&_data[(pos & _mask) * _slot_size], buf, len);
+        slot.overflow = overflow;
+        slot.len = len;
+        slot.info = info;
+        slot.seq.store(pos + 1, memory_order_release);
+        // Pairs with the fence in run(), either the writer sees the record
+        // or we see it going to sleep.
+        atomic_thread_fence(memory_order_seq_cst);
+        if (_sleeping.load(memory_order_relaxed))
+            wake();
+    }
+
+    // Number of writes which found the ring full and had to wait.
+    unsigned long full() const { return _full.load(memory_order_relaxed); }
+
+    // Number of records too long for a slot.
+    unsigned long overflows() const { return _overflows.load(memory_order_relaxed); }
+
+    private:
+    struct Slot {
+        atomic<size_t> seq;
+        int len;
+        // the record when it is longer than a slot, owned by the slot
+        char *overflow;
+        RecordInfo info;
+    };
+
+    static size_t ring_size(size_t slots)
+    {
+        size_t size = 1;
+        while (size < slots)
+            size <<= 1;
+        return size;
+    }
+
+    void wake()
+    {
+        lock_guard<mutex> guard(_lock);
+        _wakeup.notify_one();
+    }
+
+    void run()
+    {
+        Metrics::attach("queue");
+        size_t pos = 0;
+        for (;;) {
+            Slot &slot = _slots[pos & _mask];
+            if (slot.seq.load(memory_order_acquire) == pos + 1) {
+                if (slot.overflow) {
+                    _logger->write(slot.overflow, slot.len, slot.info);
+                    delete[] slot.overflow;
+                    slot.overflow = NULL;
+                } else {
+                    _logger->write(&_data[(pos & _mask) * _slot_size], slot.len, slot.info);
+                }
+                slot.seq.store(pos + _mask + 1, memory_order_release);
+                ++pos;
+                continue;
+            }
+            _logger->flush();
+            if (_stopped.load())
+                break;
+            unique_lock<mutex> guard(_lock);
+            _sleeping.store(true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (slot.seq.load(memory_order_acquire) != pos + 1 && !_stopped.load())
+                _wakeup.wait_for(guard, chrono::milliseconds(100));
+            _sleeping.store(false, memory_order_relaxed);
+        }
+    }
+
+    shared_ptr<LoggerInterface> _logger;
+    size_t _mask;
+    int _slot_size;
+    unique_ptr<Slot[]> _slots;
+    unique_ptr<char[]> _data;
+    atomic<size_t> _head;
+    atomic<bool> _stopped;
+    atomic<bool> _sleeping;
+    atomic<unsigned long> _full;
+    atomic<unsigned long> _overflows;
+    mutex _lock;
+    condition_variable _wakeup;
+    thread _writer;
+};
+
+// On-disk format of MmapLogger segments, in host byte order. A segment
+// starts with a SegmentHeader followed by 8 byte aligned records, each a
+// SegmentRecord and the payload. The record size is stored last, so a zero
+// size marks the end of the committed records even after a crash.
+struct SegmentHeader {
+    char magic[8];
+    uint64_t sequence;
+};
+
+struct SegmentRecord {
+    uint32_t size;
+    uint32_t length;
+    uint64_t timestamp;
+    uint16_t source;
+    uint8_t priority;
+    uint8_t reserved[5];
+};
+
+static const char segment_magic[8] = { 'N', 'O', 'L', 'O', 'G', 'D', '1', '\0' };
+
+// Appends records to memory mapped, preallocated segment files named
+// PATH.SEQUENCE and starts a new segment once the current one is full. A
+// roller thread creates the next segment ahead of time and trims and syncs
+// full ones, so rolling over in write() only swaps the mapping.
+class MmapLogger final : public LoggerInterface {
+    public:
+    explicit MmapLogger(const string &path, size_t segment_size = 64 * 1024 * 1024) :
+        _path(path),
+        _segment_size(align(max(segment_size, (size_t)4096))),
+        _sequence(last_sequence(path)),
+        _fd(-1),
+        _map(NULL),
+        _offset(0),
+        _retry(0),
+        _failed(false),
+        _reported(false),
+        _stopping(false)
+    {
+        Segment first;
+        if (!open_segment(_sequence + 1, first))
+            throw runtime_error("cannot create segment " + _path);
+        take(first);
+        _spare.map = NULL;
+        _roller = thread(&MmapLogger::roll, this);
+    }
+
+    // Full segments are closed by the roller, the current one is trimmed
+    // too and the unused spare removed.
+    ~MmapLogger()
+    {
+        {
+            lock_guard<mutex> guard(_lock);
+            _stopping = true;
+        }
+        _wakeup.notify_one();
+        _roller.join();
+        if (_map != NULL) {
+            Segment current = { _fd, _map, _sequence, _offset };
+            close_segment(current);
+        }
+        if (_spare.map != NULL) {
+            munmap(_spare.map, _segment_size);
+            close(_spare.fd);
+            unlink(segment_name(_path, _spare.sequence).c_str());
+        }
+    }
+
+    void write(const char *buf, int len) { write(buf, len, RecordInfo()); }
+
+    // Workers may share the logger, appending is a short copy under a lock.
+    void write(const char *buf, int len, const RecordInfo &info)
+    {
+        unique_lock<mutex> guard(_lock);
+        size_t capacity = _segment_size - sizeof(SegmentHeader) - sizeof(SegmentRecord);
+        if ((size_t)len > capacity)
+            len = capacity;
+        size_t size = align(sizeof(SegmentRecord) + len);
+        if (_map == NULL || _offset + size > _segment_size) {
+            if (!next_segment(guard))
+                return;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        SegmentRecord *record = (SegmentRecord *)(_map + _offset);
+        record->length = len;
+        record->timestamp = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        record->source = info.source;
+        // 0xff for none, or none that fits facility and severity
+        record->priority = info.priority < 0 || info.priority >= LOG_NFACILITIES << 3 ? 0xff : info.priority;
+        memcpy(record + 1, buf, len);
+        __atomic_store_n(&record->size, (uint32_t)size, __ATOMIC_RELEASE);
+        _offset += size;
+    }
+
+    private:
+    struct Segment {
+        int fd;
+        char *map;
+        uint64_t sequence;
+        // bytes used, the rest is trimmed
+        size_t offset;
+    };
+
+    static size_t align(size_t size) { return (size + 7) & ~(size_t)7; }
+
+    static string segment_name(const string &path, uint64_t sequence)
+    {
+        char suffix[24];
+        snprintf(suffix, sizeof(suffix), ".%08llu", (unsigned long long)sequence);
+        return path + suffix;
+    }
+
+    // Highest sequence number of the existing segments of path.
+    static uint64_t last_sequence(const string &path)
+    {
+        size_t slash = path.rfind('/');
+        string dir = slash == string::npos ? "." : path.substr(0, slash + 1);
+        string prefix = (slash == string::npos ? path : path.substr(slash + 1)) + ".";
+        uint64_t sequence = 0;
+        DIR *d = opendir(dir.c_str());
+        if (d == NULL)
+            return sequence;
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL) {
+            if (strncmp(entry->d_name, prefix.c_str(), prefix.size()))
+                continue;
+            char *end;
+            uint64_t n = strtoull(entry->d_name + prefix.size(), &end, 10);
+            if (*end == '\0')
+                sequence = max(sequence, n);
+        }
+        closedir(d);
+        return sequence;
+    }
+
+    // Called with the lock held. Hands the full segment to the roller and
+    // takes the one it prepared. Only if the roller is still busy with it
+    // the writer waits, while creating segments fails records are dropped.
+    bool next_segment(unique_lock<mutex> &guard)
+    {
+        if (_map != NULL) {
+            Segment full = { _fd, _map, _sequence, _offset };
+            _closing.push_back(full);
+            _map = NULL;
+            _fd = -1;
+        }
+        _wakeup.notify_one();
+        _ready.wait(guard, [this]() { return _spare.map != NULL || _failed; });
+        if (_spare.map == NULL)
+            return false;
+        take(_spare);
+        _spare.map = NULL;
+        _wakeup.notify_one();
+        return true;
+    }
+
+    void take(const Segment &segment)
+    {
+        _fd = segment.fd;
+        _map = segment.map;
+        _sequence = segment.sequence;
+        _offset = sizeof(SegmentHeader);
+    }
+
+    // The roller thread, a spare segment is created before full ones are
+    // closed, a writer may be waiting for it. After a failure it tries
+    // again a second later.
+    void roll()
+    {
+        unique_lock<mutex> guard(_lock);
+        while (!_stopping || !_closing.empty()) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+            if (!_stopping && _spare.map == NULL && ts.tv_sec >= _retry) {
+                uint64_t sequence = _sequence + 1;
+                guard.unlock();
+                Segment segment;
+                bool opened = open_segment(sequence, segment);
+                guard.lock();
+                _failed = !opened;
+                if (opened)
+                    _spare = segment;
+                else
+                    _retry = ts.tv_sec + 1;
+                _ready.notify_all();
+            } else if (!_closing.empty()) {
+                Segment full = _closing.front();
+                _closing.pop_front();
+                guard.unlock();
+                close_segment(full);
+                guard.lock();
+            } else if (!_stopping) {
+                if (_spare.map == NULL)
+                    _wakeup.wait_for(guard, chrono::seconds(1));
+                else
+                    _wakeup.wait(guard);
+            }
+        }
+    }
+
+    // Creates and maps a preallocated segment, its failures are reported
+    // once until one succeeds again.
+    bool open_segment(uint64_t sequence, Segment &segment)
+    {
+        string name = segment_name(_path, sequence);
+        int fd = open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+        int err = fd < 0 ? errno : posix_fallocate(fd, 0, _segment_size);
+        char *map = NULL;
+        if (err == 0) {
+            void *mapped = mmap(NULL, _segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapped != MAP_FAILED)
+                map = (char *)mapped;
+            else
+                err = errno;
+        }
+        if (err != 0) {
+            if (!_reported)
+                cerr << "segment " << name << ": " << strerror(err) << endl;
+            _reported = true;
+            if (fd >= 0) {
+                close(fd);
+                unlink(name.c_str());
+            }
+            return false;
+        }
+        _reported = false;
+        SegmentHeader *header = (SegmentHeader *)map;
+        memcpy(header->magic, segment_magic, sizeof(header->magic));
+        header->sequence = sequence;
+        segment.fd = fd;
+        segment.map = map;
+        segment.sequence = sequence;
+        segment.offset = sizeof(SegmentHeader);
+        return true;
+    }
+
+    // Trims the preallocated tail, a crashed process leaves it zero filled.
+    void close_segment(const Segment &segment)
+    {
+        munmap(segment.map, _segment_size);
+        if (ftruncate(segment.fd, segment.offset) == 0)
+            fdatasync(segment.fd);
+        close(segment.fd);
+    }
+
+    string _path;
+    size_t _segment_size;
+    // the segment written to
+    uint64_t _sequence;
+    int _fd;
+    char *_map;
+    size_t _offset;
+    // the next one, the full ones waiting to be closed
+    Segment _spare;
+    deque<Segment> _closing;
+    time_t _retry;
+    bool _failed;
+    // owned by the roller, see open_segment()
+    bool _reported;
+    bool _stopping;
+    mutex _lock;
+    condition_variable _wakeup;
+    condition_variable _ready;
+    thread _roller;
+};
+
+// Header of a compressed ForwardLogger frame, in network byte order. The
+// codec of a frame which didn't shrink is CODEC_NONE.
+struct FrameHeader {
+    char magic[2];
+    uint8_t version;
+    uint8_t codec;
+    uint32_t raw_length;
+    uint32_t length;
+};
+
+static const char frame_magic[2] = { 'N', 'L' };
+
+// Ships records to a remote collector, one per line, batched into frames of
+// up to frame_size bytes which are sealed when full or on flush(), i.e.
+// once per event loop iteration. Over UDP a frame is a datagram and a batch
+// of frames goes out with one sendmmsg(), over TCP frames are written back
+// to back without waiting for the peer. With a codec every frame is
+// compressed and starts with a FrameHeader. While the peer can't take them
+// frames wait in a spill queue of up to max_backlog bytes, the oldest are
+// dropped once it is full.
+class ForwardLogger final : public LoggerInterface {
+    public:
+    enum Transport { TRANSPORT_UDP, TRANSPORT_TCP };
+    enum Codec { CODEC_NONE, CODEC_LZ4, CODEC_ZSTD };
+
+    ForwardLogger(Transport transport, const struct sockaddr_storage &addr, socklen_t addr_len,
+                  Codec codec = CODEC_NONE, size_t max_backlog = 16 * 1024 * 1024) :
+        _transport(transport),
+        _addr(addr),
+        _addr_len(addr_len),
+        _codec(codec),
+        // A datagram has to fit the path MTU of an IPv6 link.
+        _frame_size((transport == TRANSPORT_UDP ? 1232 : 64 * 1024) - (codec ? sizeof(FrameHeader) : 0)),
+        _max_backlog(max_backlog),
+        _fd(-1),
+        _connected(false),
+        _offset(0),
+        _backlog(0),
+        _retry(0)
+    {
+        _frame.reserve(_frame_size);
+        open_socket();
+    }
+
+    // The peer gets a moment to take what is left.
+    ~ForwardLogger()
+    {
+        flush();
+        for (int i = 0; i < 10 && !_queue.empty() && _fd >= 0; i++) {
+            struct pollfd pfd = { _fd, POLLOUT, 0 };
+            poll(&pfd, 1, 100);
+            send();
+        }
+        if (_fd >= 0)
+            close(_fd);
+    }
+
+    void write(const char *buf, int len) { write(buf, len, RecordInfo()); }
+
+    // A record longer than a UDP frame is cut, over TCP it gets a frame of
+    // its own.
+    void write(const char *buf, int len, const RecordInfo &info)
+    {
+        size_t separator = info.framed ? 0 : 1;
+        size_t size = _transport == TRANSPORT_UDP ? min((size_t)len, _frame_size - separator) : len;
+        if (!_frame.empty() && _frame.size() + size + separator > _frame_size)
+            seal();
+        _frame.insert(_frame.end(), buf, buf + size);
+        if (separator)
+            _frame.push_back('\n');
+    }
+
+    void flush()
+    {
+        if (!_frame.empty())
+            seal();
+        if (!_queue.empty())
+            send();
+    }
+
+    // Parses udp://HOST:PORT or tcp://HOST:PORT, HOST may be a bracketed
+    // IPv6 address.
+    static bool resolve(const string &target, Transport &transport, struct sockaddr_storage &addr,
+                        socklen_t &addr_len)
+    {
+        size_t scheme = target.find("://");
+        if (scheme == string::npos)
+            return false;
+        if (target.compare(0, scheme, "udp") == 0)
+            transport = TRANSPORT_UDP;
+        else if (target.compare(0, scheme, "tcp") == 0)
+            transport = TRANSPORT_TCP;
+        else
+            return false;
+        string host = target.substr(scheme + 3);
+        size_t colon = host.rfind(':');
+        if (colon == string::npos || colon == 0)
+            return false;
+        string port = host.substr(colon + 1);
+        host.erase(colon);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = transport == TRANSPORT_UDP ? SOCK_DGRAM : SOCK_STREAM;
+        struct addrinfo *result;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+            return false;
+        memcpy(&addr, result->ai_addr, result->ai_addrlen);
+        addr_len = result->ai_addrlen;
+        freeaddrinfo(result);
+        return true;
+    }
+
+    static bool parse_codec(const char *name, Codec &codec)
+    {
+#ifdef HAVE_LZ4
+        if (!strcmp(name, "lz4")) {
+            codec = CODEC_LZ4;
+            return true;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if (!strcmp(name, "zstd")) {
+            codec = CODEC_ZSTD;
+            return true;
+        }
+#endif
+        if (!strcmp(name, "none")) {
+            codec = CODEC_NONE;
+            return true;
+        }
+        return false;
+    }
+
+    private:
+    static const int batch = 64;
+    static const uint64_t retry_ns = 1000000000ULL;
+
+    void seal()
+    {
+        vector<char> frame;
+        if (_codec == CODEC_NONE) {
+            frame.swap(_frame);
+            _frame.reserve(_frame_size);
+        } else {
+            frame = compress(_frame);
+            _frame.clear();
+        }
+        _backlog += frame.size();
+        _queue.push_back(move(frame));
+        // A frame written in part has to be finished, the stream would
+        // lose its framing otherwise.
+        while (_backlog > _max_backlog && _queue.size() > 1) {
+            auto oldest = _offset > 0 ? _queue.begin() + 1 : _queue.begin();
+            _backlog -= oldest->size();
+            _queue.erase(oldest);
+            Metrics::local().forward_dropped.add();
+        }
+        Metrics::local().forward_backlog.set(_backlog);
+    }
+
+    vector<char> compress(const vector<char> &raw)
+    {
+        size_t bound = raw.size();
+#ifdef HAVE_LZ4
+        if (_codec == CODEC_LZ4)
+            bound = max(bound, (size_t)LZ4_compressBound(raw.size()));
+#endif
+#ifdef HAVE_ZSTD
+        if (_codec == CODEC_ZSTD)
+            bound = max(bound, ZSTD_compressBound(raw.size()));
+#endif
+        vector<char> frame(sizeof(FrameHeader) + bound);
+        char *out = frame.data() + sizeof(FrameHeader);
+        size_t length = 0;
+        Codec codec = CODEC_NONE;
+#ifdef HAVE_LZ4
+        if (_codec == CODEC_LZ4) {
+            int n = LZ4_compress_default(raw.data(), out, raw.size(), bound);
+            if (n > 0) {
+                length = n;
+                codec = CODEC_LZ4;
+            }
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if (_codec == CODEC_ZSTD) {
+            size_t n = ZSTD_compress(out, bound, raw.data(), raw.size(), 1);
+            if (!ZSTD_isError(n)) {
+                length = n;
+                codec = CODEC_ZSTD;
+            }
+        }
+#endif
+        if (codec == CODEC_NONE || length >= raw.size()) {
+            memcpy(out, raw.data(), raw.size());
+            length = raw.size();
+            codec = CODEC_NONE;
+        }
+        FrameHeader *header = (FrameHeader *)frame.data();
+        memcpy(header->magic, frame_magic, sizeof(header->magic));
+        header->version = 1;
+        header->codec = codec;
+        header->raw_length = htobe32(raw.size());
+        header->length = htobe32(length);
+        frame.resize(sizeof(FrameHeader) + length);
+        return frame;
+    }
+
+    // Connecting doesn't block, a TCP connection is ready once the socket
+    // turns writable.
+    void open_socket()
+    {
+        int type = _transport == TRANSPORT_UDP ? SOCK_DGRAM : SOCK_STREAM;
+        _fd = socket(_addr.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_fd < 0) {
+            _retry = monotonic_ns() + retry_ns;
+            return;
+        }
+        if (::connect(_fd, (struct sockaddr *)&_addr, _addr_len) == 0)
+            _connected = true;
+        else if (errno == EINPROGRESS)
+            _connected = false;
+        else
+            close_socket();
+    }
+
+    // A frame cut short is sent again in full over the next connection.
+    void close_socket()
+    {
+        if (_fd >= 0)
+            close(_fd);
+        _fd = -1;
+        _connected = false;
+        _offset = 0;
+        _retry = monotonic_ns() + retry_ns;
+    }
+
+    bool ready()
+    {
+        if (_fd < 0) {
+            if (monotonic_ns() < _retry)
+                return false;
+            open_socket();
+            if (_fd < 0)
+                return false;
+        }
+        if (!_connected) {
+            struct pollfd pfd = { _fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, 0) <= 0)
+                return false;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                close_socket();
+                return false;
+            }
+            _connected = true;
+        }
+        return true;
+    }
+
+    void send()
+    {
+        if (ready()) {
+            if (_transport == TRANSPORT_UDP)
+                send_datagrams();
+            else
+                send_stream();
+        }
+        Metrics::local().forward_backlog.set(_backlog);
+    }
+
+    void sent(size_t frames, size_t bytes)
+    {
+        Metrics &metrics = Metrics::local();
+        metrics.forward_frames.add(frames);
+        metrics.forward_bytes.add(bytes);
+    }
+
+    void send_datagrams()
+    {
+        while (!_queue.empty()) {
+            struct mmsghdr msgs[batch];
+            struct iovec iov[batch];
+            int count = min(_queue.size(), (size_t)batch);
+            memset(msgs, 0, sizeof(msgs[0]) * count);
+            for (int i = 0; i < count; i++) {
+                iov[i].iov_base = _queue[i].data();
+                iov[i].iov_len = _queue[i].size();
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int n = sendmmsg(_fd, msgs, count, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EMSGSIZE) {
+                    _backlog -= _queue.front().size();
+                    _queue.pop_front();
+                    Metrics::local().forward_dropped.add();
+                    continue;
+                }
+                // A refused datagram reports the collector being down,
+                // it is tried again after a while.
+                if (errno != EAGAIN)
+                    close_socket();
+                return;
+            }
+            size_t bytes = 0;
+            for (int i = 0; i < n; i++) {
+                bytes += _queue.front().size();
+                _queue.pop_front();
+            }
+            _backlog -= bytes;
+            sent(n, bytes);
+        }
+    }
+
+    void send_stream()
+    {
+        while (!_queue.empty()) {
+            struct iovec iov[batch];
+            int count = min(_queue.size(), (size_t)batch);
+            for (int i = 0; i < count; i++) {
+                iov[i].iov_base = _queue[i].data();
+                iov[i].iov_len = _queue[i].size();
+            }
+            iov[0].iov_base = (char *)iov[0].iov_base + _offset;
+            iov[0].iov_len -= _offset;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ssize_t n = sendmsg(_fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN)
+                    close_socket();
+                return;
+            }
+            size_t frames = 0;
+            size_t bytes = n;
+            n += _offset;
+            while (!_queue.empty() && (size_t)n >= _queue.front().size()) {
+                n -= _queue.front().size();
+                _backlog -= _queue.front().size();
+                _queue.pop_front();
+                frames++;
+            }
+            _offset = n;
+            sent(frames, bytes);
+        }
+    }
+
+    Transport _transport;
+    struct sockaddr_storage _addr;
+    socklen_t _addr_len;
+    Codec _codec;
+    size_t _frame_size;
+    size_t _max_backlog;
+    int _fd;
+    bool _connected;
+    // bytes of the first queued frame already written to the stream
+    size_t _offset;
+    size_t _backlog;
+    uint64_t _retry;
+    vector<char> _frame;
+    deque<vector<char>> _queue;
+};
+
+// Hands every record to several sinks, each with a writer thread of its own
+// fed through a bounded ring. A record is copied once, into a reference
+// counted immutable slice shared by the rings of all sinks. A sink drops the
+// syslog records its filter matches, and loses records while its ring is
+// full instead of holding up the event loops and the other sinks.
+class FanoutLogger final : public LoggerInterface {
+    public:
+    explicit FanoutLogger(size_t slots = 4096) :
+        _slots(slots) {}
+
+    // Producers must be done by now, the sinks write what they have queued.
+    ~FanoutLogger() { _sinks.clear(); }
+
+    // Sinks are added before the first record is written.
+    void add(const string &name, shared_ptr<LoggerInterface> logger, shared_ptr<SyslogFilter> filter, bool format)
+    {
+        _sinks.emplace_back(new Sink(name, logger, filter, format, _slots));
+    }
+
+    void write(const char *buf, int len) { write(buf, len, RecordInfo()); }
+
+    // The fields and stream header of the record are only valid in the
+    // stages before, the writer threads get the rest of its info.
+    void write(const char *buf, int len, const RecordInfo &info)
+    {
+        if (_sinks.empty())
+            return;
+        Slice *slice = (Slice *)malloc(offsetof(Slice, data) + len);
+        if (slice == NULL)
+            return;
+        new (&slice->refs) atomic<unsigned>(_sinks.size());
+        slice->len = len;
+        new (&slice->info) RecordInfo(info.source, info.priority);
+        slice->info.framed = info.framed;
+        memcpy(slice->data, buf, len);
+        for (auto &sink : _sinks)
+            if (!sink->push(slice))
+                release(slice);
+    }
+
+    void report(ostream &out) const
+    {
+        for (auto &sink : _sinks) {
+            out << "sink " << sink->name << ": " << sink->full() << " records lost to a full queue" << endl;
+            if (!sink->filter)
+                continue;
+            for (auto &rule : sink->filter->rules())
+                out << "sink " << sink->name << " drop " << rule.selector << ": " << rule.hits << " records" << endl;
+        }
+    }
+
+    private:
+    struct Slice {
+        atomic<unsigned> refs;
+        int len;
+        RecordInfo info;
+        char data[1];
+    };
+
+    static void release(Slice *slice)
+    {
+        if (slice->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            slice->info.~RecordInfo();
+            slice->refs.~atomic<unsigned>();
+            free(slice);
+        }
+    }
+
+    // Same ring as QueueLogger's, of slices instead of copies.
+    class Sink {
+        public:
+        Sink(const string &name, shared_ptr<LoggerInterface> logger, shared_ptr<SyslogFilter> filter, bool format,
+             size_t slots) :
+            name(name),
+            filter(filter),
+            _logger(logger),
+            _format(format),
+            _pipeline(FormatStage(), logger),
+            _mask(ring_size(slots) - 1),
+            _slots(new Slot[_mask + 1]),
+            _head(0),
+            _stopped(false),
+            _sleeping(false),
+            _full(0)
+        {
+            for (size_t i = 0; i <= _mask; i++)
+                _slots[i].seq.store(i, memory_order_relaxed);
+            _writer = thread(&Sink::run, this);
+        }
+
+        ~Sink()
+        {
+            _stopped.store(true);
+            wake();
+            _writer.join();
+        }
+
+        bool push(Slice *slice)
+        {
+            size_t pos = _head.load(memory_order_relaxed);
+            for (;;) {
+                Slot &slot = _slots[pos & _mask];
+                intptr_t diff = (intptr_t)slot.seq.load(memory_order_acquire) - (intptr_t)pos;
+                if (diff == 0) {
+                    if (_head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                        slot.slice = slice;
+                        slot.seq.store(pos + 1, memory_order_release);
+                        break;
+                    }
+                } else if (diff < 0) {
+                    _full.fetch_add(1, memory_order_relaxed);
+                    return false;
+                } else {
+                    pos = _head.load(memory_order_relaxed);
+                }
+            }
+            // Pairs with the fence in run(), as in QueueLogger.
+            atomic_thread_fence(memory_order_seq_cst);
+            if (_sleeping.load(memory_order_relaxed))
+                wake();
+            return true;
+        }
+
+        unsigned long full() const { return _full.load(memory_order_relaxed); }
+
+        const string name;
+        // only used by the writer thread
+        const shared_ptr<SyslogFilter> filter;
+
+        private:
+        struct Slot {
+            atomic<size_t> seq;
+            Slice *slice;
+        };
+
+        static size_t ring_size(size_t slots)
+        {
+            size_t size = 1;
+            while (size < slots)
+                size <<= 1;
+            return size;
+        }
+
+        void wake()
+        {
+            lock_guard<mutex> guard(_lock);
+            _wakeup.notify_one();
+        }
+
+        void deliver(const Slice *slice)
+        {
+            if (filter && slice->info.source == SOURCE_SYSLOG && filter->drop(slice->info.priority, slice->data, slice->len))
+                return;
+            if (_format)
+                _pipeline.write((char *)slice->data, slice->len, slice->info);
+            else
+                _logger->write(slice->data, slice->len, slice->info);
+        }
+
+        // Formatted records get the time the writer takes them, read once
+        // per wakeup like in the event loops.
+        void run()
+        {
+            Metrics::attach("sink " + name);
+            size_t pos = 0;
+            WallClock::tick();
+            for (;;) {
+                Slot &slot = _slots[pos & _mask];
+                if (slot.seq.load(memory_order_acquire) == pos + 1) {
+                    Slice *slice = slot.slice;
+                    slot.seq.store(pos + _mask + 1, memory_order_release);
+                    ++pos;
+                    deliver(slice);
+                    release(slice);
+                    continue;
+                }
+                _logger->flush();
+                if (_stopped.load())
+                    break;
+                unique_lock<mutex> guard(_lock);
+                _sleeping.store(true, memory_order_relaxed);
+                atomic_thread_fence(memory_order_seq_cst);
+                if (slot.seq.load(memory_order_acquire) != pos + 1 && !_stopped.load())
+                    _wakeup.wait_for(guard, chrono::milliseconds(100));
+                _sleeping.store(false, memory_order_relaxed);
+                WallClock::tick();
+            }
+        }
+
+        shared_ptr<LoggerInterface> _logger;
+        bool _format;
+        Pipeline<FormatStage, LoggerInterface> _pipeline;
+        size_t _mask;
+        unique_ptr<Slot[]> _slots;
+        atomic<size_t> _head;
+        atomic<bool> _stopped;
+        atomic<bool> _sleeping;
+        atomic<unsigned long> _full;
+        mutex _lock;
+        condition_variable _wakeup;
+        thread _writer;
+    };
+
+    size_t _slots;
+    vector<unique_ptr<Sink>> _sinks;
+};
+
+void epoll_addwatch(int epoll_fd, int sock_fd, uint32_t flags = EPOLLIN)
+{
+    struct epollin_event:epoll_event {
+        epollin_event(int fd, uint32_t flags)
+        {
+            events = flags;
+            data.fd = fd;
+        }
+    } ev (sock_fd, flags);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev);
+}
+
+void fd_set_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Sockets passed in by systemd socket activation or by a previous nologd
+// handing over, see Handover. Listening sockets are told apart by type and
+// address rather than by name, so socket units may name them as they like.
+// Fds named "connection" are stream connections whose headers and partial
+// lines are in the one named "nologd-state".
+class Inherited {
+    public:
+    static Inherited &get()
+    {
+        static Inherited inherited;
+        return inherited;
+    }
+
+    // Takes the listening socket of the given type bound to path, -1 if
+    // none was passed.
+    int take(int type, const char *path)
+    {
+        for (auto it = _listeners.begin(); it != _listeners.end(); ++it) {
+            int fd = *it;
+            int fd_type;
+            socklen_t len = sizeof(fd_type);
+            struct sockaddr_un sa;
+            socklen_t slen = sizeof(sa);
+            if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &fd_type, &len) < 0 || fd_type != type)
+                continue;
+            if (getsockname(fd, (struct sockaddr *)&sa, &slen) < 0 || sa.sun_family != AF_UNIX ||
+                slen <= offsetof(struct sockaddr_un, sun_path) ||
+                strncmp(sa.sun_path, path, slen - offsetof(struct sockaddr_un, sun_path)))
+                continue;
+            _listeners.erase(it);
+            fd_set_nonblock(fd);
+            return fd;
+        }
+        return -1;
+    }
+
+    // Closes the listening sockets nobody took.
+    void close_unused()
+    {
+        for (int fd : _listeners)
+            close(fd);
+        _listeners.clear();
+    }
+
+    // Stream connections and their partial lines.
+    vector<pair<int, string>> connections;
+
+    private:
+    static const int listen_fds_start = 3;
+
+    Inherited()
+    {
+        const char *pid = getenv("LISTEN_PID");
+        const char *fds = getenv("LISTEN_FDS");
+        const char *names = getenv("LISTEN_FDNAMES");
+        string fd_names = names ? names : "";
+        int count = fds && pid && atoi(pid) == getpid() ? atoi(fds) : 0;
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+        int state = -1;
+        size_t pos = 0;
+        for (int fd = listen_fds_start; fd < listen_fds_start + count; fd++) {
+            size_t colon = min(fd_names.find(':', pos), fd_names.size());
+            string name = fd_names.substr(min(pos, fd_names.size()), colon - min(pos, fd_names.size()));
+            pos = colon + 1;
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            if (name == "connection")
+                connections.push_back(make_pair(fd, string()));
+            else if (name == "nologd-state")
+                state = fd;
+            else
+                _listeners.push_back(fd);
+        }
+        if (state >= 0) {
+            restore(state);
+            close(state);
+        }
+    }
+
+    // The state holds the header and partial line of each connection in
+    // order, as a native 32 bit length followed by the data.
+    void restore(int state)
+    {
+        struct stat st;
+        if (fstat(state, &st) < 0 || st.st_size == 0)
+            return;
+        string data(st.st_size, '\0');
+        if (pread(state, &data[0], data.size(), 0) != (ssize_t)data.size())
+            return;
+        size_t pos = 0;
+        for (auto &connection : connections) {
+            uint32_t len;
+            if (data.size() - pos < sizeof(len))
+                break;
+            memcpy(&len, &data[pos], sizeof(len));
+            pos += sizeof(len);
+            if (len > data.size() - pos)
+                break;
+            connection.second = data.substr(pos, len);
+            pos += len;
+        }
+    }
+
+    vector<int> _listeners;
+};
+
+int unix_open(int type, const char *path)
+{
+    int inherited = Inherited::get().take(type, path);
+    if (inherited >= 0)
+        return inherited;
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    int fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        // The directory of a journal namespace may not exist yet.
+        string dir = path;
+        dir.erase(min(dir.rfind('/'), dir.size()));
+        if (!dir.empty())
+            mkdir(dir.c_str(), 0755);
+        unlink(path);
+        strncpy(&sa.sun_path[0], path, NELEMS(sa.sun_path));
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+int unix_accept(int stdout_fd)
+{
+    int fd;
+    struct sockaddr_un sa;
+    socklen_t slen = sizeof(sa);
+    fd = accept4(stdout_fd, (struct sockaddr *)&sa, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    return fd;
+}
+
+// The path a unix socket is bound to, for an accepted connection the one of
+// its listening socket.
+string unix_path(int fd)
+{
+    struct sockaddr_un sa;
+    socklen_t slen = sizeof(sa);
+    if (getsockname(fd, (struct sockaddr *)&sa, &slen) < 0 || sa.sun_family != AF_UNIX ||
+        slen <= offsetof(struct sockaddr_un, sun_path))
+        return string();
+    return string(sa.sun_path, strnlen(sa.sun_path, slen - offsetof(struct sockaddr_un, sun_path)));
+}
+
+class SocketObservable : public EventLoopInterface {
+    public:
+    // With busy_poll_ns the loop keeps polling for that long after the
+    // last events before it blocks, see wait().
+    explicit SocketObservable(int max_events = 64, uint64_t busy_poll_ns = 0) :
+        epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+        wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        events(max_events),
+        busy_poll_ns(busy_poll_ns),
+        last_event(0)
+    {
+        epoll_addwatch(epoll_fd, wake_fd);
+    }
+    ~SocketObservable() {}
+
+    void addObserver(shared_ptr<Observer> &observer)
+    {
+        addObserver(observer, EPOLLIN);
+    }
+
+    void addObserver(shared_ptr<Observer> &observer, uint32_t flags)
+    {
+        unsigned key = observer->key();
+        if (key >= observers.size())
+            observers.resize(max(key + 1, (unsigned)observers.size() * 2));
+        if (!observers[key])
+            epoll_addwatch(epoll_fd, key, flags);
+        observers[key] = observer;
+    }
+
+    void addHook(function<void()> hook)
+    {
+        hooks.push_back(hook);
+    }
+
+    void delObserver(int key)
+    {
+        if ((unsigned)key >= observers.size() || !observers[key])
+            return;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, key, NULL);
+        // Observers removed while dispatching are kept alive until the whole
+        // batch of events is handled, so their fds can't be reused by a new
+        // observer and receive events that were meant for the old one.
+        released.push_back(move(observers[key]));
+    }
+
+    void delObserver(shared_ptr<Observer> &observer)
+    {
+        delObserver(observer->key());
+    }
+
+    void loop() throw (runtime_error)
+    {
+        Metrics &metrics = Metrics::local();
+        while (!stopped) {
+            int r = wait();
+            if (r < 0) {
+                if (errno != EINTR)
+                    throw runtime_error("epoll_wait failed");
+                Metrics::dump_requested();
+                continue;
+            }
+            WallClock::tick();
+            uint64_t start = monotonic_ns();
+            dispatch(r);
+            for (auto &hook : hooks)
+                hook();
+            released.clear();
+            metrics.wakeups.add();
+            metrics.events.add(r);
+            metrics.dispatch.add(monotonic_ns() - start);
+            Metrics::dump_requested();
+        }
+        if (!upgrading)
+            drain_sockets();
+        for (auto &hook : hooks)
+            hook();
+    }
+
+    void wakeup()
+    {
+        uint64_t one = 1;
+        ::write(wake_fd, &one, sizeof(one));
+    }
+
+    private:
+    // A busy loop finds its next events without going to sleep and being
+    // woken up, at the cost of a CPU spinning on epoll_wait() meanwhile.
+    // Spinning only follows activity, an idle loop blocks right away.
+    int wait()
+    {
+        Metrics &metrics = Metrics::local();
+        uint64_t now = busy_poll_ns > 0 ? monotonic_ns() : 0;
+        if (now > 0 && now < last_event + busy_poll_ns) {
+            uint64_t start = now;
+            do {
+                int r = epoll_wait(epoll_fd, &events[0], events.size(), 0);
+                now = monotonic_ns();
+                if (r != 0) {
+                    metrics.spin_ns.add(now - start);
+                    if (r > 0) {
+                        metrics.spin_hits.add();
+                        last_event = now;
+                    }
+                    return r;
+                }
+                metrics.spin_misses.add();
+            } while (now < last_event + busy_poll_ns && !stopped);
+            metrics.spin_ns.add(now - start);
+        }
+        if (busy_poll_ns > 0)
+            metrics.sleeps.add();
+        int r = epoll_wait(epoll_fd, &events[0], events.size(), -1);
+        if (r > 0 && busy_poll_ns > 0)
+            last_event = monotonic_ns();
+        return r;
+    }
+
+    // Returns the number of observers notified.
+    int dispatch(int count)
+    {
+        int notified = 0;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.fd == wake_fd) {
+                uint64_t wakeups;
+                ::read(wake_fd, &wakeups, sizeof(wakeups));
+                continue;
+            }
+            Observer *observer = observers[events[i].data.fd].get();
+            if (observer) {
+                observer->notify(*this);
+                ++notified;
+            }
+        }
+        return notified;
+    }
+
+    // Datagram sockets are level triggered and stay ready until they are
+    // empty, connections that are still open are read until EAGAIN.
+    void drain_sockets()
+    {
+        while (monotonic_ns() < deadline) {
+            int r = epoll_wait(epoll_fd, &events[0], events.size(), 0);
+            if (r < 0 && errno == EINTR)
+                continue;
+            WallClock::tick();
+            int notified = r > 0 ? dispatch(r) : 0;
+            for (auto &hook : hooks)
+                hook();
+            released.clear();
+            if (notified == 0)
+                break;
+        }
+    }
+
+    int epoll_fd;
+    int wake_fd;
+    vector<struct epoll_event> events;
+    uint64_t busy_poll_ns;
+    uint64_t last_event;
+    // Indexed by fd, kernel allocates the lowest free fd so it stays dense.
+    vector<shared_ptr<Observer>> observers;
+    vector<shared_ptr<Observer>> released;
+    list<function<void()>> hooks;
+};
+
+class DatagramObserver : public ObservableInterface<int>::Observer {
+    public:
+    DatagramObserver(const char *path, shared_ptr<ReaderInterface> reader) :
+        sock_fd(unix_open(SOCK_DGRAM, path)),
+        _reader(reader)
+    {
+        if (sock_fd < 0)
+            throw runtime_error("socket failed");
+        fd_set_nonblock(sock_fd);
+        // Drop counts are delivered where the socket family supports them.
+        int on = 1;
+        setsockopt(sock_fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+        _reader->attach(sock_fd);
+    }
+
+    // Watches the socket of another observer from a different worker.
+    DatagramObserver(const DatagramObserver &listener, shared_ptr<ReaderInterface> reader) :
+        sock_fd(fcntl(listener.sock_fd, F_DUPFD_CLOEXEC, 0)),
+        _reader(reader)
+    {
+        if (sock_fd < 0)
+            throw runtime_error("dup failed");
+        _reader->attach(sock_fd);
+    }
+
+    ~DatagramObserver() { close(sock_fd); }
+
+    void notify(ObservableInterface<int> &notification) { _reader->read(sock_fd); }
+
+    int key() const { return sock_fd; }
+
+    // Set when the event loop may receive messages for the reader.
+    ReceiverInterface *receiver() const { return dynamic_cast<ReceiverInterface *>(_reader.get()); }
+
+    private:
+    int sock_fd;
+    shared_ptr<ReaderInterface> _reader;
+};
+
+#ifdef HAVE_IO_URING
+// Event loop on an io_uring instance. Observers are watched with multishot
+// poll, except datagram sockets whose reader can take single messages, they
+// get a multishot recvmsg into a ring of provided buffers, and listening
+// sockets whose observer accepts connections, they get a multishot accept.
+// Either way a ready socket no longer costs a wakeup and a read() syscall.
+// Output writes are submitted to the same ring, see UringLogger.
+class UringObservable : public EventLoopInterface {
+    public:
+    explicit UringObservable(unsigned entries = 256, uint64_t busy_poll_ns = 0) :
+        ring_fd(-1),
+        wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        sq_map(MAP_FAILED),
+        cq_map(MAP_FAILED),
+        sqes(NULL),
+        writing(0),
+        quiescing(false),
+        busy_poll_ns(busy_poll_ns),
+        last_event(0)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0 && errno == EINVAL) {
+            memset(&params, 0, sizeof(params));
+            ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (ring_fd < 0) {
+            close(wake_fd);
+            throw runtime_error("io_uring_setup failed");
+        }
+        sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sq_bytes = cq_bytes = max(sq_bytes, cq_bytes);
+        sq_map = mmap(NULL, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+        cq_map = single ? sq_map : mmap(NULL, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        ring_fd, IORING_OFF_CQ_RING);
+        void *map = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+        if (map != MAP_FAILED)
+            sqes = (struct io_uring_sqe *)map;
+        if (sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqes == NULL) {
+            unmap();
+            throw runtime_error("io_uring mmap failed");
+        }
+        char *sq = (char *)sq_map;
+        sq_head = (unsigned *)(sq + params.sq_off.head);
+        sq_ktail = (unsigned *)(sq + params.sq_off.tail);
+        sq_array = (unsigned *)(sq + params.sq_off.array);
+        sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_tail = *sq_ktail;
+        char *cq = (char *)cq_map;
+        cq_head = (unsigned *)(cq + params.cq_off.head);
+        cq_ktail = (unsigned *)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        arm_wake();
+    }
+
+    ~UringObservable() { unmap(); }
+
+    void addObserver(shared_ptr<Observer> &observer)
+    {
+        addObserver(observer, EPOLLIN);
+    }
+
+    void addObserver(shared_ptr<Observer> &observer, uint32_t flags)
+    {
+        unsigned key = observer->key();
+        if (key >= watches.size())
+            watches.resize(max(key + 1, (unsigned)watches.size() * 2));
+        Watch &watch = watches[key];
+        bool armed = (bool)watch.observer;
+        watch.observer = observer;
+        if (armed)
+            return;
+        // Edge triggering and exclusive wakeups have no meaning for
+        // completions of a single ring.
+        watch.events = flags & ~(EPOLLET | EPOLLEXCLUSIVE | EPOLLONESHOT);
+        watch.op = OP_POLL;
+        watch.receiver = NULL;
+        watch.acceptor = dynamic_cast<AcceptorInterface *>(observer.get());
+        if (watch.acceptor)
+            watch.op = OP_ACCEPT;
+        DatagramObserver *datagram = dynamic_cast<DatagramObserver *>(observer.get());
+        if (datagram && datagram->receiver() && buffers(key, *datagram->receiver())) {
+            watch.op = OP_RECV;
+            watch.receiver = datagram->receiver();
+        }
+        // Sockets added while stopping are left to drain_sockets().
+        if (!quiescing)
+            arm(key);
+    }
+
+    void addHook(function<void()> hook)
+    {
+        hooks.push_back(hook);
+    }
+
+    void delObserver(int key)
+    {
+        if ((unsigned)key >= watches.size() || !watches[key].observer)
+            return;
+        Watch &watch = watches[key];
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = tag(watch.gen, watch.op, key);
+        sqe->user_data = tag(0, OP_CANCEL, 0);
+        // Completions still queued for the old observer don't match the new
+        // generation and are ignored, the fd may be reused right away.
+        watch.gen++;
+        released.push_back(move(watch.observer));
+        // So may its buffer group id. The buffers are kept until the batch
+        // is handled, receivers may still hold messages in them.
+        if ((unsigned)key < groups.size() && groups[key]) {
+            struct io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.bgid = key;
+            syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            released_groups.push_back(move(groups[key]));
+        }
+    }
+
+    void delObserver(shared_ptr<Observer> &observer)
+    {
+        delObserver(observer->key());
+    }
+
+    void loop()
+    {
+        Metrics &metrics = Metrics::local();
+        while (!stopped) {
+            if (wait() < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                throw runtime_error("io_uring_enter failed");
+            WallClock::tick();
+            uint64_t start = monotonic_ns();
+            reap();
+            size_t count = completed.size();
+            dispatch();
+            for (auto &hook : hooks)
+                hook();
+            released.clear();
+            released_groups.clear();
+            if (count > 0) {
+                metrics.wakeups.add();
+                metrics.events.add(count);
+                metrics.dispatch.add(monotonic_ns() - start);
+            }
+            Metrics::dump_requested();
+        }
+        quiesce();
+        if (!upgrading)
+            drain_sockets();
+        // Output submitted to the ring is written before the loop returns.
+        for (auto &hook : hooks)
+            hook();
+        drain();
+    }
+
+    void wakeup()
+    {
+        uint64_t one = 1;
+        ::write(wake_fd, &one, sizeof(one));
+    }
+
+    // Submits a write of buf, done is called with its result.
+    void write(int fd, const void *buf, size_t len, function<void(int)> done)
+    {
+        unsigned slot;
+        if (free_writes.empty()) {
+            slot = writes.size();
+            writes.push_back(done);
+        } else {
+            slot = free_writes.back();
+            free_writes.pop_back();
+            writes[slot] = done;
+        }
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = len;
+        // write at, and advance, the file position like write(2)
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = tag(slot, OP_WRITE, 0);
+        writing++;
+    }
+
+    // Waits until all submitted writes are completed, other completions
+    // are left for the loop.
+    void drain()
+    {
+        while (writing > 0) {
+            if (enter(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                break;
+            reap();
+            size_t kept = 0;
+            for (size_t i = 0; i < completed.size(); i++) {
+                if (((completed[i].user_data >> 24) & 0xff) == OP_WRITE)
+                    complete(completed[i]);
+                else
+                    completed[kept++] = completed[i];
+            }
+            completed.resize(kept);
+        }
+    }
+
+    private:
+    // Cancels the requests on the watched sockets and handles whatever they
+    // completed before, messages and connections the kernel has already
+    // taken from a socket would be lost with the ring.
+    void quiesce()
+    {
+        drain();
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = tag(1, OP_CANCEL, 0);
+        quiescing = true;
+        bool cancelled = false;
+        while (!cancelled) {
+            if (enter(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                break;
+            reap();
+            for (auto &completion : completed)
+                cancelled = cancelled || completion.user_data == tag(1, OP_CANCEL, 0);
+            dispatch();
+        }
+        // Completions of the cancelled requests may still be pending as
+        // task work, which runs on entering the ring.
+        syscall(__NR_io_uring_enter, ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+        reap();
+        dispatch();
+    }
+
+    // Once the ring requests are gone the observers read their sockets
+    // themselves, as long as poll() finds any of them ready.
+    void drain_sockets()
+    {
+        vector<struct pollfd> ready;
+        while (monotonic_ns() < deadline) {
+            ready.clear();
+            for (size_t fd = 0; fd < watches.size(); fd++) {
+                if (watches[fd].observer) {
+                    struct pollfd pfd = { (int)fd, (short)watches[fd].events, 0 };
+                    ready.push_back(pfd);
+                }
+            }
+            int r = poll(&ready[0], ready.size(), 0);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            WallClock::tick();
+            for (auto &pfd : ready) {
+                if (pfd.revents && watches[pfd.fd].observer)
+                    watches[pfd.fd].observer->notify(*this);
+            }
+            for (auto &hook : hooks)
+                hook();
+            released.clear();
+            released_groups.clear();
+            drain();
+        }
+    }
+
+    enum Op {
+        OP_POLL,
+        OP_RECV,
+        OP_ACCEPT,
+        OP_CANCEL,
+        OP_WAKE,
+        OP_WRITE
+    };
+
+    struct Watch {
+        Watch() : gen(0), op(OP_POLL), events(0), receiver(NULL), acceptor(NULL) {}
+
+        shared_ptr<Observer> observer;
+        uint32_t gen;
+        int op;
+        uint32_t events;
+        ReceiverInterface *receiver;
+        AcceptorInterface *acceptor;
+    };
+
+    // Provided buffers of a datagram socket, each one takes the recvmsg
+    // header, the ancillary data and the payload of a single message.
+    struct BufferGroup {
+        BufferGroup() : ring(NULL) {}
+        ~BufferGroup()
+        {
+            if (ring != NULL)
+                munmap(ring, ring_bytes);
+        }
+
+        struct msghdr msg;
+        size_t size;
+        unsigned entries;
+        uint16_t tail;
+        // struct io_uring_buf_ring, its tail overlays the resv field of
+        // the first entry. The header's flexible array doesn't start at
+        // offset 0 when compiled as C++, so it isn't used.
+        struct io_uring_buf *ring;
+        size_t ring_bytes;
+        unique_ptr<char[]> data;
+        vector<uint16_t> returned;
+    };
+
+    struct Completion {
+        uint64_t user_data;
+        int res;
+        unsigned flags;
+    };
+
+    static const size_t buffer_memory = 4 * 1024 * 1024;
+    static const unsigned max_buffers = 64;
+
+    // user_data keeps the generation (or write slot), the operation and the fd.
+    static uint64_t tag(uint32_t gen, int op, int fd)
+    {
+        return (uint64_t)gen << 32 | (uint64_t)op << 24 | (fd & 0xffffff);
+    }
+
+    void unmap()
+    {
+        groups.clear();
+        released_groups.clear();
+        if (sqes != NULL)
+            munmap(sqes, sqes_bytes);
+        if (cq_map != MAP_FAILED && cq_map != sq_map)
+            munmap(cq_map, cq_bytes);
+        if (sq_map != MAP_FAILED)
+            munmap(sq_map, sq_bytes);
+        if (ring_fd >= 0)
+            close(ring_fd);
+        close(wake_fd);
+    }
+
+    struct io_uring_sqe *get_sqe()
+    {
+        if (sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+            enter(0);
+        unsigned index = sq_tail & sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        ++sq_tail;
+        return sqe;
+    }
+
+    // Busy polls like SocketObservable::wait(), on the completion queue,
+    // which is shared memory, so spinning takes no syscalls.
+    int wait()
+    {
+        Metrics &metrics = Metrics::local();
+        uint64_t now = busy_poll_ns > 0 ? monotonic_ns() : 0;
+        if (now > 0 && now < last_event + busy_poll_ns) {
+            uint64_t start = now;
+            if (enter(0) < 0)
+                return -1;
+            do {
+                if (*cq_head != __atomic_load_n(cq_ktail, __ATOMIC_ACQUIRE)) {
+                    last_event = monotonic_ns();
+                    metrics.spin_ns.add(last_event - start);
+                    metrics.spin_hits.add();
+                    return 0;
+                }
+                metrics.spin_misses.add();
+                cpu_relax();
+                now = monotonic_ns();
+            } while (now < last_event + busy_poll_ns && !stopped);
+            metrics.spin_ns.add(now - start);
+        }
+        if (busy_poll_ns == 0)
+            return enter(1);
+        metrics.sleeps.add();
+        int r = enter(1);
+        last_event = monotonic_ns();
+        return r;
+    }
+
+    int enter(unsigned min_complete)
+    {
+        __atomic_store_n(sq_ktail, sq_tail, __ATOMIC_RELEASE);
+        unsigned pending = sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (pending == 0 && min_complete == 0)
+            return 0;
+        return syscall(__NR_io_uring_enter, ring_fd, pending, min_complete,
+                       min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }
+
+    void reap()
+    {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_ktail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe &cqe = cqes[head & cq_mask];
+            Completion completion = { cqe.user_data, cqe.res, cqe.flags };
+            completed.push_back(completion);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    void arm_wake()
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = wake_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = tag(0, OP_WAKE, wake_fd);
+    }
+
+    void arm(int fd)
+    {
+        Watch &watch = watches[fd];
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->fd = fd;
+        sqe->user_data = tag(watch.gen, watch.op, fd);
+        switch (watch.op) {
+        case OP_POLL:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = watch.events;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            break;
+        case OP_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            break;
+        case OP_RECV:
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->addr = (uintptr_t)&groups[fd]->msg;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = fd;
+            sqe->msg_flags = MSG_CMSG_CLOEXEC;
+            break;
+        }
+    }
+
+    // Registers the buffer ring of a datagram socket, its group id is the fd.
+    bool buffers(int fd, ReceiverInterface &receiver)
+    {
+        if ((unsigned)fd >= groups.size())
+            groups.resize(fd + 1);
+        size_t size = sizeof(struct io_uring_recvmsg_out) + receiver.control_size() + receiver.message_size();
+        if (groups[fd] && groups[fd]->size == size)
+            return true;
+        if (groups[fd] || fd > UINT16_MAX)
+            return false;
+        unsigned entries = 1;
+        while (entries < max_buffers && entries * 2 * size <= buffer_memory)
+            entries *= 2;
+        unique_ptr<BufferGroup> group(new BufferGroup);
+        memset(&group->msg, 0, sizeof(group->msg));
+        group->msg.msg_controllen = receiver.control_size();
+        group->size = size;
+        group->entries = entries;
+        group->tail = 0;
+        group->ring_bytes = entries * sizeof(struct io_uring_buf);
+        void *ring = mmap(NULL, group->ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+            return false;
+        group->ring = (struct io_uring_buf *)ring;
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uintptr_t)ring;
+        reg.ring_entries = entries;
+        reg.bgid = fd;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return false;
+        group->data.reset(new char[entries * size]);
+        for (unsigned bid = 0; bid < entries; bid++)
+            group->returned.push_back(bid);
+        recycle(*group);
+        groups[fd] = move(group);
+        return true;
+    }
+
+    void recycle(BufferGroup &group)
+    {
+        for (uint16_t bid : group.returned) {
+            struct io_uring_buf &buf = group.ring[group.tail++ & (group.entries - 1)];
+            buf.addr = (uintptr_t)&group.data[bid * group.size];
+            buf.len = group.size;
+            buf.bid = bid;
+        }
+        group.returned.clear();
+        __atomic_store_n(&group.ring[0].resv, group.tail, __ATOMIC_RELEASE);
+    }
+
+    // Handles the completions, buffers are given back to the kernel only
+    // after the receivers are done with the whole batch.
+    void dispatch()
+    {
+        while (!completed.empty()) {
+            batch.swap(completed);
+            for (auto &completion : batch)
+                complete(completion);
+            batch.clear();
+        }
+        for (auto receiver : receivers)
+            receiver->received();
+        receivers.clear();
+        for (auto &group : groups) {
+            if (group && !group->returned.empty())
+                recycle(*group);
+        }
+        for (auto &rearm : rearms) {
+            if (!quiescing && watches[rearm.first].observer && watches[rearm.first].gen == rearm.second)
+                arm(rearm.first);
+        }
+        rearms.clear();
+    }
+
+    void complete(const Completion &completion)
+    {
+        int fd = completion.user_data & 0xffffff;
+        int op = (completion.user_data >> 24) & 0xff;
+        uint32_t gen = completion.user_data >> 32;
+        int res = completion.res;
+        bool more = completion.flags & IORING_CQE_F_MORE;
+
+        if (op == OP_CANCEL)
+            return;
+        if (op == OP_WAKE) {
+            uint64_t count;
+            ::read(wake_fd, &count, sizeof(count));
+            if (!more)
+                arm_wake();
+            return;
+        }
+        if (op == OP_WRITE) {
+            function<void(int)> done;
+            done.swap(writes[gen]);
+            free_writes.push_back(gen);
+            writing--;
+            done(res);
+            return;
+        }
+
+        bool current = (unsigned)fd < watches.size() && watches[fd].observer && watches[fd].gen == gen;
+        char *buf = NULL;
+        // A buffer of a group released since belongs to nobody, the group
+        // of the same id may be a new one.
+        if (op == OP_RECV && (completion.flags & IORING_CQE_F_BUFFER) && current && groups[fd]) {
+            BufferGroup &group = *groups[fd];
+            uint16_t bid = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (bid < group.entries) {
+                buf = &group.data[bid * group.size];
+                group.returned.push_back(bid);
+            }
+        }
+        if (!current) {
+            if (op == OP_ACCEPT && res >= 0)
+                close(res);
+            return;
+        }
+        Watch &watch = watches[fd];
+        if (!more)
+            rearms.push_back(make_pair(fd, gen));
+        if (res < 0) {
+            // Without multishot support in the kernel the socket is polled
+            // and its observer reads as with epoll.
+            if (op != OP_POLL && (res == -EINVAL || res == -EOPNOTSUPP))
+                watch.op = OP_POLL;
+            // Out of fds the listener refuses the backlog itself.
+            else if (op == OP_ACCEPT && (res == -EMFILE || res == -ENFILE))
+                watch.observer->notify(*this);
+            return;
+        }
+        switch (op) {
+        case OP_POLL:
+            // Removed observers are released after the batch, see dispatch().
+            watch.observer->notify(*this);
+            break;
+        case OP_ACCEPT:
+            watch.acceptor->accepted(*this, res);
+            break;
+        case OP_RECV:
+            if (buf != NULL)
+                receive(*groups[fd], *watch.receiver, buf, res);
+            break;
+        }
+    }
+
+    void receive(BufferGroup &group, ReceiverInterface &receiver, char *buf, size_t len)
+    {
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+        char *control = (char *)(out + 1) + group.msg.msg_namelen;
+        char *payload = control + group.msg.msg_controllen;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = out->controllen > 0 ? control : NULL;
+        msg.msg_controllen = out->controllen;
+        msg.msg_flags = out->flags;
+        // payloadlen is the length of the datagram, which may be truncated
+        // to the space left in the buffer
+        receiver.receive(msg, payload, min((size_t)out->payloadlen, (size_t)(buf + len - payload)));
+        bool known = false;
+        for (auto r : receivers)
+            known = known || r == &receiver;
+        if (!known)
+            receivers.push_back(&receiver);
+    }
+
+    int ring_fd;
+    int wake_fd;
+    void *sq_map;
+    void *cq_map;
+    struct io_uring_sqe *sqes;
+    size_t sq_bytes;
+    size_t cq_bytes;
+    size_t sqes_bytes;
+    unsigned *sq_head;
+    unsigned *sq_ktail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_tail;
+    unsigned *cq_head;
+    unsigned *cq_ktail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Indexed by fd like the observers of SocketObservable.
+    vector<Watch> watches;
+    vector<unique_ptr<BufferGroup>> groups;
+    // groups of removed observers, released with them after the batch
+    vector<unique_ptr<BufferGroup>> released_groups;
+    vector<Completion> completed;
+    vector<Completion> batch;
+    vector<ReceiverInterface *> receivers;
+    vector<pair<int, uint32_t>> rearms;
+    vector<function<void(int)>> writes;
+    vector<unsigned> free_writes;
+    unsigned writing;
+    // set once the requests are cancelled, none are rearmed
+    bool quiescing;
+    uint64_t busy_poll_ns;
+    uint64_t last_event;
+    vector<shared_ptr<Observer>> released;
+    list<function<void()>> hooks;
+};
+
+// Writes to a file through the ring of an event loop, so the loop never
+// blocks on its output: records are collected while the previous batch is
+// being written. More than max_bytes pending waits for that write.
+class UringLogger final : public LoggerInterface {
+    public:
+    UringLogger(UringObservable &ring, int fileno, size_t max_bytes = 256 * 1024) :
+        _ring(ring),
+        _fileno(fileno),
+        _max_bytes(max_bytes),
+        _offset(0),
+        _busy(false),
+        _submitted(0) {}
+    ~UringLogger()
+    {
+        // The loop drains its writes when it stops, what is left was never
+        // submitted.
+        if (!_busy) {
+            size_t offset = 0;
+            while (offset < _pending.size()) {
+                ssize_t written = ::write(_fileno, &_pending[offset], _pending.size() - offset);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    break;
+                offset += written;
+            }
+        }
+    }
+    void write(const char *buf, int len) { write(buf, len, RecordInfo()); }
+    void write(const char *buf, int len, const RecordInfo &info)
+    {
+        if (!info.framed)
+            _pending.push_back('\n');
+        _pending.insert(_pending.end(), buf, buf + len);
+        if (_pending.size() >= _max_bytes) {
+            if (_busy)
+                _ring.drain();
+            flush();
+        }
+    }
+    void flush()
+    {
+        if (_busy || _pending.empty())
+            return;
+        _writing.swap(_pending);
+        _pending.clear();
+        _offset = 0;
+        _busy = true;
+        submit();
+    }
+    private:
+    void submit()
+    {
+        _submitted = monotonic_ns();
+        _ring.write(_fileno, &_writing[_offset], _writing.size() - _offset,
+                    [this](int res) { written(res); });
+    }
+
+    void written(int res)
+    {
+        Metrics &metrics = Metrics::local();
+        metrics.writes.add();
+        metrics.write.add(monotonic_ns() - _submitted);
+        if (res == -EINTR || res == -EAGAIN || (res > 0 && _offset + res < _writing.size())) {
+            if (res > 0)
+                _offset += res;
+            submit();
+            return;
+        }
+        _busy = false;
+        _writing.clear();
+        flush();
+    }
+
+    UringObservable &_ring;
+    int _fileno;
+    size_t _max_bytes;
+    size_t _offset;
+    bool _busy;
+    uint64_t _submitted;
+    vector<char> _pending;
+    vector<char> _writing;
+};
+#endif
+
+// Hands out objects constructed in place in slabs of slab_size. Released
+// objects are kept as they are for reuse, so acquire() only allocates when
+// it has to add a slab, and its args are only used to construct that one.
+// All objects share the reference count of their slabs instead of having a
+// control block each, the slabs go away with the last reference to any of
+// the objects.
+template <class T, size_t slab_size = 64>
+class SlabPool {
+    public:
+    SlabPool() :
+        _slabs(make_shared<Slabs>()) {}
+
+    template <typename... Args>
+    shared_ptr<T> acquire(Args&&... args)
+    {
+        if (_free.empty())
+            grow(forward<Args>(args)...);
+        T *object = _free.back();
+        _free.pop_back();
+        return shared_ptr<T>(_slabs, object);
+    }
+
+    void release(T *object) { _free.push_back(object); }
+
+    // Objects retired while a batch of events is handled are released by
+    // collect() once it is over, after f finished them.
+    void retire(T *object) { _retired.push_back(object); }
+
+    template <class F>
+    void collect(F f)
+    {
+        for (T *object : _retired) {
+            f(*object);
+            _free.push_back(object);
+        }
+        _retired.clear();
+    }
+
+    // Calls f with every object constructed so far, handed out or not.
+    template <class F>
+    void for_each(F f)
+    {
+        Slabs &slabs = *_slabs;
+        for (size_t i = 0; i < slabs._slabs.size(); i++) {
+            size_t count = i + 1 < slabs._slabs.size() ? slab_size : slabs._last;
+            for (size_t j = 0; j < count; j++)
+                f(*(T *)&slabs._slabs[i][j]);
+        }
+    }
+
+    private:
+    typedef typename aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+    struct Slabs {
+        ~Slabs()
+        {
+            for (size_t i = 0; i < _slabs.size(); i++) {
+                size_t count = i + 1 < _slabs.size() ? slab_size : _last;
+                for (size_t j = 0; j < count; j++)
+                    ((T *)&_slabs[i][j])->~T();
+            }
+        }
+
+        vector<unique_ptr<Storage[]>> _slabs;
+        // objects constructed in the last slab
+        size_t _last;
+    };
+
+    template <typename... Args>
+    void grow(Args&&... args)
+    {
+        Slabs &slabs = *_slabs;
+        slabs._slabs.emplace_back(new Storage[slab_size]);
+        slabs._last = 0;
+        _free.reserve(slabs._slabs.size() * slab_size);
+        for (size_t j = 0; j < slab_size; j++) {
+            T *object = new (&slabs._slabs.back()[j]) T(args...);
+            slabs._last++;
+            _free.push_back(object);
+        }
+        // Handed out in address order.
+        reverse(_free.end() - slab_size, _free.end());
+    }
+
+    shared_ptr<Slabs> _slabs;
+    vector<T *> _free;
+    vector<T *> _retired;
+};
+
+// What StdoutObserver hands to the connections it accepts.
+struct StreamChain {
+    shared_ptr<HandlerInterface> handler;
+    // Set when stream data may bypass line reassembly and the handler.
+    shared_ptr<ReaderInterface> passthrough;
+};
+
+// The chain is borrowed from the StdoutObserver that owns the pool.
+class StreamObserver : public ObservableInterface<int>::Observer {
+    public:
+    StreamObserver(SlabPool<StreamObserver> &pool, StreamChain &chain) :
+        sock_fd(-1),
+        _pool(pool),
+        _reader(chain.handler.get(), chain.passthrough != NULL),
+        _passthrough(chain.passthrough.get()) {}
+    ~StreamObserver()
+    {
+        if (sock_fd >= 0)
+            ::close(sock_fd);
+    }
+
+    void open(int fd, const string &partial = string())
+    {
+        sock_fd = fd;
+        _reader.restore(fd, partial);
+    }
+
+    string pending() const { return _reader.pending(); }
+
+    void finish()
+    {
+        if (sock_fd >= 0)
+            _reader.finish();
+    }
+
+    void close()
+    {
+        ::close(sock_fd);
+        sock_fd = -1;
+    }
+
+    // On EOF the connection is retired to the pool of the StdoutObserver
+    // that accepted it, which closes it after the batch, so its fd isn't
+    // handed out again while events meant for it may still be dispatched.
+    // The header of the stream is read before any data passes through.
+    void notify(ObservableInterface<int> &notification)
+    {
+        bool open;
+        if (_passthrough && _reader.headed()) {
+            _reader.drain();
+            open = _passthrough->read(sock_fd);
+        } else {
+            open = _reader.read(sock_fd);
+        }
+        if (!open) {
+            Metrics::local().streams_closed.add();
+            notification.delObserver(sock_fd);
+            _pool.retire(this);
+        }
+    }
+
+    int key() const { return sock_fd; }
+
+    private:
+    int sock_fd;
+    SlabPool<StreamObserver> &_pool;
+    LineReader _reader;
+    StageRef<ReaderInterface> _passthrough;
+};
+
+class StdoutObserver : public ObservableInterface<int>::Observer, public AcceptorInterface {
+    public:
+    StdoutObserver(const char *path, const StreamChain &chain) :
+        sock_fd(unix_open(SOCK_STREAM, path)),
+        _chain(chain),
+        _reserve(open("/dev/null", O_RDONLY | O_CLOEXEC))
+    {
+        if (sock_fd < 0)
+            throw runtime_error("socket failed");
+        listen(sock_fd, SOMAXCONN);
+    }
+
+    StdoutObserver(const StdoutObserver &listener, const StreamChain &chain) :
+        sock_fd(fcntl(listener.sock_fd, F_DUPFD_CLOEXEC, 0)),
+        _chain(chain),
+        _reserve(open("/dev/null", O_RDONLY | O_CLOEXEC))
+    {
+        if (sock_fd < 0)
+            throw runtime_error("dup failed");
+    }
+
+    ~StdoutObserver()
+    {
+        close(sock_fd);
+        if (_reserve >= 0)
+            close(_reserve);
+    }
+
+    int key() const { return sock_fd; }
+
+    // Registered edge triggered, so accept the whole backlog at once. Out of
+    // fds the backlog is refused, it wouldn't signal the listener again.
+    void notify(ObservableInterface<int> &notification)
+    {
+        for (;;) {
+            int fd = unix_accept(sock_fd);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if ((errno == EMFILE || errno == ENFILE) && _reserve >= 0) {
+                    if (refuse())
+                        continue;
+                    break;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    cerr << "accept failed: " << strerror(errno) << endl;
+                break;
+            }
+            accepted(notification, fd);
+        }
+    }
+
+    // Closes the connections which ended in the batch just handled.
+    void collect()
+    {
+        _pool.collect([](StreamObserver &connection) { connection.close(); });
+    }
+
+    void accepted(ObservableInterface<int> &notification, int fd) { adopt(notification, fd, string()); }
+
+    // Takes over a connection with the partial line read from it so far.
+    void adopt(ObservableInterface<int> &notification, int fd, const string &partial)
+    {
+        shared_ptr<StreamObserver> connection = _pool.acquire(_pool, _chain);
+        connection->open(fd, partial);
+        Metrics::local().streams_opened.add();
+        shared_ptr<ObservableInterface<int>::Observer> streamObserver = move(connection);
+        notification.addObserver(streamObserver);
+    }
+
+    // Calls f with the fd and partial line of every open connection.
+    template <class F>
+    void connections(F f)
+    {
+        _pool.for_each([&f](StreamObserver &connection) {
+            if (connection.key() >= 0)
+                f(connection.key(), connection.pending());
+        });
+    }
+
+    // Passes on what the open connections hold back, when they are not
+    // handed over.
+    void finish()
+    {
+        _pool.for_each([](StreamObserver &connection) { connection.finish(); });
+    }
+
+    private:
+    // Accepts a connection with the fd kept in reserve and closes it, false
+    // once there is none left.
+    bool refuse()
+    {
+        close(_reserve);
+        int fd = unix_accept(sock_fd);
+        if (fd >= 0) {
+            close(fd);
+            Metrics::local().streams_refused.add();
+        }
+        _reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return fd >= 0;
+    }
+
+    int sock_fd;
+    StreamChain _chain;
+    SlabPool<StreamObserver> _pool;
+    // an fd to give up for refusing connections while out of fds
+    int _reserve;
+};
+
+// Takes the signals of the process from a signalfd in an event loop, so
+// handling them isn't restricted to what is async-signal-safe and a loop
+// blocked waiting for events can't miss them.
+class SignalObserver : public ObservableInterface<int>::Observer {
+    public:
+    SignalObserver(const sigset_t &signals, function<void(int)> handler) :
+        sock_fd(signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)),
+        _handler(handler)
+    {
+        if (sock_fd < 0)
+            throw runtime_error("signalfd failed");
+    }
+
+    ~SignalObserver() { close(sock_fd); }
+
+    void notify(ObservableInterface<int> &notification)
+    {
+        struct signalfd_siginfo info;
+        while (::read(sock_fd, &info, sizeof(info)) == sizeof(info))
+            _handler(info.ssi_signo);
+    }
+
+    int key() const { return sock_fd; }
+
+    private:
+    int sock_fd;
+    function<void(int)> _handler;
+};
+
+// Wakes an event loop every interval_ms, so its hooks run while no events
+// come in, e.g. to retry forwarding the spill queue.
+class TimerObserver : public ObservableInterface<int>::Observer {
+    public:
+    explicit TimerObserver(int interval_ms) :
+        sock_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+    {
+        if (sock_fd < 0)
+            throw runtime_error("timerfd failed");
+        struct itimerspec spec;
+        spec.it_interval.tv_sec = interval_ms / 1000;
+        spec.it_interval.tv_nsec = interval_ms % 1000 * 1000000L;
+        spec.it_value = spec.it_interval;
+        timerfd_settime(sock_fd, 0, &spec, NULL);
+    }
+
+    ~TimerObserver() { close(sock_fd); }
+
+    void notify(ObservableInterface<int> &notification)
+    {
+        uint64_t expirations;
+        while (::read(sock_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            ;
+    }
+
+    int key() const { return sock_fd; }
+
+    private:
+    int sock_fd;
+};
+
+struct Options {
+    enum Order {
+        // Every datagram socket is served by a single worker and every
+        // stream connection by the worker that accepted it.
+        ORDER_SOURCE,
+        // Workers share all sockets and one output, reads are serialised.
+        ORDER_GLOBAL
+    };
+
+    enum Engine {
+        ENGINE_EPOLL,
+        ENGINE_URING
+    };
+
+    // Outputs a FanoutLogger can feed.
+    enum Sink {
+        SINK_STDOUT,
+        SINK_MMAP,
+        SINK_FORWARD,
+        SINKS
+    };
+
+    static const char *const sink_names[SINKS];
+
+    // A socket to listen on, see --listen.
+    struct Listener {
+        // SOURCE_SYSLOG, SOURCE_JOURNAL or SOURCE_STDOUT, which tells the
+        // socket type and the pipeline its records go through
+        int source;
+        string path;
+        // a symlink to path created once it is bound, e.g. /dev/log
+        string link;
+        // the sink its records are written to, -1 for the default output
+        int sink;
+    };
+
+    int batch;
+    int events;
+    size_t write_buffer;
+    int write_delay;
+    int workers;
+    Order order;
+    size_t queue;
+    SyslogFilter filter;
+    string segment_path;
+    size_t segment_size;
+    bool replay;
+    bool splice;
+    Engine engine;
+    unsigned rate_burst;
+    int rate_interval;
+    size_t dedup_records;
+    int dedup_interval;
+    bool format;
+    // OUTPUT_TEXT, OUTPUT_JSON or OUTPUT_BINARY
+    Output output;
+    int shutdown_timeout;
+    string forward;
+    ForwardLogger::Codec codec;
+    size_t forward_queue;
+    // bit mask of the sinks, 0 writes to the single output
+    unsigned sinks;
+    SyslogFilter sink_filters[SINKS];
+    size_t sink_queue;
+    // worker i runs on cpus[i % cpus.size()]
+    vector<int> cpus;
+    vector<int> writer_cpus;
+    int busy_poll;
+    // the journald sockets unless any are given
+    vector<Listener> listeners;
+
+    Options() :
+        batch(64),
+        events(64),
+        write_buffer(0),
+        write_delay(100),
+        workers(1),
+        order(ORDER_SOURCE),
+        queue(0),
+        segment_size(64 * 1024 * 1024),
+        replay(false),
+        splice(false),
+        engine(ENGINE_EPOLL),
+        rate_burst(0),
+        rate_interval(30),
+        dedup_records(0),
+        dedup_interval(30),
+        format(false),
+        output(OUTPUT_TEXT),
+        shutdown_timeout(1000),
+        codec(ForwardLogger::CODEC_NONE),
+        forward_queue(16 * 1024 * 1024),
+        sinks(0),
+        sink_queue(4096),
+        busy_poll(0) {}
+
+    static void usage(const char *prog)
+    {
+        cerr << "usage: " << prog << " [options]" << endl
+             << "       " << prog << " --replay SEGMENT..." << endl
+             << "  -b, --batch=SLOTS  receive up to SLOTS datagrams per recvmmsg() call," << endl
+             << "                     at most 1024, 0 reads one datagram per read() call" << endl
+             << "                     (default 64)" << endl
+             << "  -e, --events=COUNT dispatch up to COUNT ready sockets per epoll_wait()" << endl
+             << "                     call (default 64)" << endl
+             << "  -w, --write-buffer=BYTES" << endl
+             << "                     coalesce output and flush it with writev() once per" << endl
+             << "                     event loop iteration or when BYTES are pending," << endl
+             << "                     0 writes every record immediately (default 0)" << endl
+             << "  -d, --write-delay=MSEC" << endl
+             << "                     flush buffered output older than MSEC (default 100)" << endl
+             << "  -j, --workers=COUNT" << endl
+             << "                     run COUNT event loops in separate threads (default 1)" << endl
+             << "  -o, --order=source|global" << endl
+             << "                     keep records of each socket or connection in order," << endl
+             << "                     or all records in order at the cost of serialising" << endl
+             << "                     workers (default source)" << endl
+             << "  -q, --queue=SLOTS  hand records to a separate writer thread through a" << endl
+             << "                     lock-free ring of SLOTS records, 0 writes from the" << endl
+             << "                     event loop (default 0)" << endl
+             << "  -x, --drop=FACILITY.SEVERITY[:IDENTIFIER]" << endl
+             << "                     drop syslog records of FACILITY at SEVERITY or below," << endl
+             << "                     either may be '*', may be given several times" << endl
+             << "  -p, --splice       pass stdout stream data through to stdout with splice()," << endl
+             << "                     without line framing; only with a single worker and" << endl
+             << "                     stream listeners alone writing to stdout, ignored with" << endl
+             << "                     --mmap, --queue, --format, --output, --forward, --sinks," << endl
+             << "                     --dedup and ring output" << endl
+             << "  -m, --mmap=PATH    append binary records to memory mapped segment files" << endl
+             << "                     PATH.NUMBER instead of writing text to stdout" << endl
+             << "  -s, --segment-size=BYTES" << endl
+             << "                     size of a segment file (default 64 MiB)" << endl
+             << "  -u, --engine=ENGINE" << endl
+             << "                     event loop, 'epoll' or 'uring' (default epoll); uring" << endl
+             << "                     receives datagrams and accepts connections with" << endl
+             << "                     multishot requests and, with a single worker writing" << endl
+             << "                     to stdout, submits the output to the same ring" << endl
+             << "  -l, --rate-limit=MSGS[/SECS]" << endl
+             << "                     let each sending process pass MSGS datagrams per SECS" << endl
+             << "                     (default 30) and suppress the rest, 0 disables (default 0)" << endl
+             << "  -D, --dedup=RECORDS[/SECS]" << endl
+             << "                     collapse repeats of the last RECORDS distinct records" << endl
+             << "                     into a \"message repeated N times\" record per SECS" << endl
+             << "                     (default 30), 0 disables (default 0)" << endl
+             << "  -f, --format       prefix records with their time, source and priority;" << endl
+             << "                     ignored with --mmap" << endl
+             << "  -O, --output=text|json|binary" << endl
+             << "                     write records as text lines, JSON lines or length" << endl
+             << "                     prefixed binary records with all journal fields;" << endl
+             << "                     ignored with --mmap (default text)" << endl
+             << "  -t, --shutdown-timeout=MSEC" << endl
+             << "                     on SIGTERM and SIGINT keep reading the sockets until" << endl
+             << "                     they are empty, for up to MSEC (default 1000)" << endl
+             << "  -F, --forward=udp://HOST:PORT|tcp://HOST:PORT" << endl
+             << "                     send records to a collector in batched frames instead" << endl
+             << "                     of writing them to stdout" << endl
+             << "  -z, --compress=CODEC" << endl
+             << "                     compress forwarded frames, 'none'"
+#ifdef HAVE_LZ4
+             << ", 'lz4'"
+#endif
+#ifdef HAVE_ZSTD
+             << ", 'zstd'"
+#endif
+             << " (default none)" << endl
+             << "  -Q, --forward-queue=BYTES" << endl
+             << "                     keep up to BYTES of frames while the collector can't" << endl
+             << "                     take them, then drop the oldest (default 16 MiB)" << endl
+             << "  -S, --sinks=SINK[,SINK]..." << endl
+             << "                     write every record to several of 'stdout', 'mmap'" << endl
+             << "                     (needs --mmap) and 'forward' (needs --forward), each" << endl
+             << "                     from a writer thread of its own" << endl
+             << "  -X, --sink-drop=SINK:FACILITY.SEVERITY[:IDENTIFIER]" << endl
+             << "                     like --drop, for a single sink" << endl
+             << "  -K, --sink-queue=SLOTS" << endl
+             << "                     records queued per sink, more are lost (default 4096)" << endl
+             << "  -c, --cpus=LIST    run worker i on the i-th CPU of LIST, e.g. 0,2-3, with" << endl
+             << "                     its buffers on the NUMA node of that CPU" << endl
+             << "  -W, --writer-cpus=LIST" << endl
+             << "                     run the queue and sink writer threads on the CPUs of LIST" << endl
+             << "  -B, --busy-poll=USEC" << endl
+             << "                     keep polling for events for USEC after the last ones" << endl
+             << "                     before blocking, 0 blocks right away (default 0)" << endl
+             << "  -L, --listen=PROTOCOL:PATH[:SINK]" << endl
+             << "                     listen on PATH for 'syslog', 'journal' or 'stdout'" << endl
+             << "                     clients instead of the journald sockets, writing" << endl
+             << "                     their records to SINK, may be given several times" << endl
+             << "  -N, --namespace=NAME[:SINK]" << endl
+             << "                     listen on the sockets of journal namespace NAME in" << endl
+             << "                     /run/systemd/journal.NAME" << endl
+             << "  -C, --config=FILE  read 'listen' and 'namespace' lines from FILE" << endl
+             << "  -r, --replay       print the records of the given segment files" << endl
+             << "  -h, --help         show this help" << endl;
+    }
+
+    static int lookup_sink(const string &name)
+    {
+        for (int i = 0; i < SINKS; i++)
+            if (name == sink_names[i])
+                return i;
+        return -1;
+    }
+
+    // PROTOCOL:PATH[:SINK]
+    bool add_listener(const string &spec)
+    {
+        static const char *const protocols[] = { "-", "syslog", "journal", "stdout" };
+        size_t colon = spec.find(':');
+        if (colon == string::npos)
+            return false;
+        Listener listener = { SOURCE_NONE, spec.substr(colon + 1), "", -1 };
+        for (int source = SOURCE_SYSLOG; source <= SOURCE_STDOUT; source++)
+            if (!spec.compare(0, colon, protocols[source]))
+                listener.source = source;
+        size_t last = listener.path.rfind(':');
+        if (last != string::npos && lookup_sink(listener.path.substr(last + 1)) >= 0) {
+            listener.sink = lookup_sink(listener.path.substr(last + 1));
+            listener.path.erase(last);
+        }
+        if (listener.source == SOURCE_NONE || listener.path.empty() ||
+            listener.path.size() >= sizeof(((struct sockaddr_un *)NULL)->sun_path))
+            return false;
+        listeners.push_back(listener);
+        return true;
+    }
+
+    // NAME[:SINK], the sockets journald binds for a namespace.
+    bool add_namespace(const string &spec)
+    {
+        size_t colon = spec.find(':');
+        string name = spec.substr(0, colon);
+        string sink = colon == string::npos ? "" : spec.substr(colon);
+        if (name.empty() || name.find('/') != string::npos)
+            return false;
+        string dir = "/run/systemd/journal." + name;
+        return add_listener("syslog:" + dir + "/dev-log" + sink) &&
+            add_listener("journal:" + dir + "/socket" + sink) &&
+            add_listener("stdout:" + dir + "/stdout" + sink);
+    }
+
+    // Lines "listen SPEC" and "namespace SPEC" as for --listen and
+    // --namespace, empty lines and lines starting with '#' are skipped.
+    bool load(const char *path)
+    {
+        ifstream file(path);
+        if (!file) {
+            cerr << "cannot open " << path << endl;
+            return false;
+        }
+        string line;
+        for (int number = 1; getline(file, line); number++) {
+            istringstream words(line);
+            string keyword, spec, rest;
+            words >> keyword >> spec >> rest;
+            if (keyword.empty() || keyword[0] == '#')
+                continue;
+            if (!rest.empty() || !(keyword == "listen" ? add_listener(spec) :
+                                   keyword == "namespace" && add_namespace(spec))) {
+                cerr << path << ":" << number << ": invalid line" << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A decimal, octal or hex number in 0..max, as strtol() reads it.
+    static bool parse_number(const char *arg, long max, long &value)
+    {
+        char *end;
+        errno = 0;
+        value = strtol(arg, &end, 0);
+        return end != arg && !*end && errno != ERANGE && value >= 0 && value <= max;
+    }
+
+    void parse(int argc, char *argv[])
+    {
+        static const struct option long_options[] = {
+            { "batch", required_argument, NULL, 'b' },
+            { "events", required_argument, NULL, 'e' },
+            { "write-buffer", required_argument, NULL, 'w' },
+            { "write-delay", required_argument, NULL, 'd' },
+            { "workers", required_argument, NULL, 'j' },
+            { "order", required_argument, NULL, 'o' },
+            { "queue", required_argument, NULL, 'q' },
+            { "drop", required_argument, NULL, 'x' },
+            { "splice", no_argument, NULL, 'p' },
+            { "mmap", required_argument, NULL, 'm' },
+            { "segment-size", required_argument, NULL, 's' },
+            { "engine", required_argument, NULL, 'u' },
+            { "rate-limit", required_argument, NULL, 'l' },
+            { "dedup", required_argument, NULL, 'D' },
+            { "format", no_argument, NULL, 'f' },
+            { "output", required_argument, NULL, 'O' },
+            { "shutdown-timeout", required_argument, NULL, 't' },
+            { "forward", required_argument, NULL, 'F' },
+            { "compress", required_argument, NULL, 'z' },
+            { "forward-queue", required_argument, NULL, 'Q' },
+            { "sinks", required_argument, NULL, 'S' },
+            { "sink-drop", required_argument, NULL, 'X' },
+            { "sink-queue", required_argument, NULL, 'K' },
+            { "cpus", required_argument, NULL, 'c' },
+            { "writer-cpus", required_argument, NULL, 'W' },
+            { "busy-poll", required_argument, NULL, 'B' },
+            { "listen", required_argument, NULL, 'L' },
+            { "namespace", required_argument, NULL, 'N' },
+            { "config", required_argument, NULL, 'C' },
+            { "replay", no_argument, NULL, 'r' },
+            { "help", no_argument, NULL, 'h' },
+            { NULL, 0, NULL, 0 }
+        };
+        int opt;
+        while ((opt = getopt_long(argc, argv, "b:e:w:d:j:o:q:x:pm:s:u:l:D:fO:t:F:z:Q:S:X:K:c:W:B:L:N:C:rh", long_options, NULL)) != -1) {
+            switch (opt) {
+            case 'b': {
+                // recvmmsg() takes at most UIO_MAXIOV messages per call
+                long value;
+                if (!parse_number(optarg, UIO_MAXIOV, value)) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                batch = value;
+                break;
+            }
+            case 'e':
+                events = max(atoi(optarg), 1);
+                break;
+            case 'w': {
+                long value;
+                if (!parse_number(optarg, INT_MAX, value)) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                write_buffer = value;
+                break;
+            }
+            case 'd':
+                write_delay = atoi(optarg);
+                break;
+            case 'j':
+                workers = max(atoi(optarg), 1);
+                break;
+            case 'o':
+                if (!strcmp(optarg, "source")) {
+                    order = ORDER_SOURCE;
+                } else if (!strcmp(optarg, "global")) {
+                    order = ORDER_GLOBAL;
+                } else {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'q':
+                queue = strtoul(optarg, NULL, 0);
+                break;
+            case 'x':
+                try {
+                    filter.add(optarg);
+                } catch (runtime_error &err) {
+                    cerr << err.what() << endl;
+                    exit(1);
+                }
+                break;
+            case 'p':
+                splice = true;
+                break;
+            case 'm':
+                segment_path = optarg;
+                break;
+            case 's':
+                segment_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                if (!strcmp(optarg, "epoll")) {
+                    engine = ENGINE_EPOLL;
+                } else if (!strcmp(optarg, "uring")) {
+                    engine = ENGINE_URING;
+                } else {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'l': {
+                char *end;
+                rate_burst = strtoul(optarg, &end, 0);
+                if (*end == '/')
+                    rate_interval = atoi(end + 1);
+                if (rate_interval <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            case 'D': {
+                char *end;
+                dedup_records = strtoul(optarg, &end, 0);
+                if (*end == '/')
+                    dedup_interval = atoi(end + 1);
+                if (dedup_interval <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            case 'f':
+                format = true;
+                break;
+            case 'O':
+                if (!strcmp(optarg, "text")) {
+                    output = OUTPUT_TEXT;
+                } else if (!strcmp(optarg, "json")) {
+                    output = OUTPUT_JSON;
+                } else if (!strcmp(optarg, "binary")) {
+                    output = OUTPUT_BINARY;
+                } else {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 't':
+                shutdown_timeout = max(atoi(optarg), 0);
+                break;
+            case 'F':
+                forward = optarg;
+                break;
+            case 'z':
+                if (!ForwardLogger::parse_codec(optarg, codec)) {
+                    cerr << "unsupported codec " << optarg << endl;
+                    exit(1);
+                }
+                break;
+            case 'Q':
+                forward_queue = strtoul(optarg, NULL, 0);
+                break;
+            case 'S': {
+                string list = optarg;
+                size_t start = 0;
+                while (start <= list.size()) {
+                    size_t end = list.find(',', start);
+                    if (end == string::npos)
+                        end = list.size();
+                    int sink = lookup_sink(list.substr(start, end - start));
+                    if (sink < 0) {
+                        usage(argv[0]);
+                        exit(1);
+                    }
+                    sinks |= 1 << sink;
+                    start = end + 1;
+                }
+                break;
+            }
+            case 'X': {
+                const char *colon = strchr(optarg, ':');
+                int sink = colon ? lookup_sink(string(optarg, colon - optarg)) : -1;
+                if (sink < 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                try {
+                    sink_filters[sink].add(colon + 1);
+                } catch (runtime_error &err) {
+                    cerr << err.what() << endl;
+                    exit(1);
+                }
+                break;
+            }
+            case 'K':
+                sink_queue = max(strtoul(optarg, NULL, 0), 1UL);
+                break;
+            case 'c':
+            case 'W':
+                if (!CpuBinding::parse(optarg, opt == 'c' ? cpus : writer_cpus)) {
+                    cerr << "invalid cpu list " << optarg << endl;
+                    exit(1);
+                }
+                break;
+            case 'B':
+                busy_poll = max(atoi(optarg), 0);
+                break;
+            case 'L':
+            case 'N':
+                if (!(opt == 'L' ? add_listener(optarg) : add_namespace(optarg))) {
+                    cerr << "invalid listener " << optarg << endl;
+                    exit(1);
+                }
+                break;
+            case 'C':
+                if (!load(optarg))
+                    exit(1);
+                break;
+            case 'r':
+                replay = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                usage(argv[0]);
+                exit(1);
+            }
+        }
+        if (listeners.empty()) {
+            add_listener("syslog:/run/systemd/journal/dev-log");
+            listeners.back().link = "/dev/log";
+            add_listener("journal:/run/systemd/journal/socket");
+            add_listener("stdout:/run/systemd/journal/stdout");
+        }
+    }
+};
+
+const char *const Options::sink_names[Options::SINKS] = { "stdout", "mmap", "forward" };
+
+// Prints the records of segment files written by MmapLogger.
+int replay(char *const *paths, int count)
+{
+    static const char *const sources[] = { "-", "syslog", "journal", "stdout" };
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        int fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SegmentHeader))
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0)
+            close(fd);
+        if (map == MAP_FAILED || memcmp(map, segment_magic, sizeof(segment_magic))) {
+            cerr << paths[i] << ": not a segment file" << endl;
+            if (map != MAP_FAILED)
+                munmap(map, st.st_size);
+            status = 1;
+            continue;
+        }
+        size_t size = st.st_size;
+        size_t offset = sizeof(SegmentHeader);
+        madvise(map, size, MADV_SEQUENTIAL);
+        while (offset + sizeof(SegmentRecord) <= size) {
+            const SegmentRecord *record = (const SegmentRecord *)((char *)map + offset);
+            if (record->size < sizeof(SegmentRecord) + record->length || record->size > size - offset)
+                break;
+            char stamp[32];
+            time_t secs = record->timestamp / 1000000;
+            struct tm tm;
+            strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime_r(&secs, &tm));
+            printf("%s.%06u %s ", stamp, (unsigned)(record->timestamp % 1000000),
+                   record->source < NELEMS(sources) ? sources[record->source] : "-");
+            if (record->priority >= LOG_NFACILITIES << 3)
+                printf("- ");
+            else
+                printf("%u ", record->priority);
+            fwrite(record + 1, 1, record->length, stdout);
+            putchar('\n');
+            offset += record->size;
+        }
+        munmap(map, size);
     }
+    return status;
+}
+
+// Event loop of a single thread together with its processing chain.
+struct Worker {
+    explicit Worker(EventLoopInterface *watcher) :
+        watcher(watcher) {}
+
+    unique_ptr<EventLoopInterface> watcher;
+    // Per listener, the reader of a datagram socket the worker serves, or
+    // what a stream listener hands to the connections it accepts.
+    vector<shared_ptr<ReaderInterface>> readers;
+    vector<StreamChain> streams;
+    shared_ptr<SyslogFilter> syslogFilter;
+    // The handlers of all listeners, what they hold back is passed on when
+    // the worker stops.
+    vector<shared_ptr<HandlerInterface>> pipelines;
+};
+
+struct Handlers {
+    shared_ptr<HandlerInterface> syslog;
+    shared_ptr<HandlerInterface> journal;
+    shared_ptr<HandlerInterface> stream;
+};
+
+// Ends the given stages in the logger, with a FormatStage or EncodeStage in
+// between for the output other than plain text.
+template <class Logger, class... Stages>
+shared_ptr<HandlerInterface> compose(const shared_ptr<Logger> &logger, Output output, const Stages &... stages)
+{
+    if (output == OUTPUT_FORMAT)
+        return make_shared<PipelineHandler<Stages..., FormatStage, Logger>>(stages..., FormatStage(), logger);
+    if (output == OUTPUT_JSON || output == OUTPUT_BINARY)
+        return make_shared<PipelineHandler<Stages..., EncodeStage, Logger>>(stages..., EncodeStage(output == OUTPUT_BINARY),
+                                                                            logger);
+    return make_shared<PipelineHandler<Stages..., Logger>>(stages..., logger);
+}
+
+// Every pipeline gets a copy of dedup, repeats are collapsed per source.
+template <class Logger>
+Handlers compose_handlers(const shared_ptr<Logger> &logger, const shared_ptr<SyslogFilter> &filter, Output output,
+                          const DedupStage &dedup)
+{
+    Handlers handlers;
+    handlers.syslog = compose(logger, output, SyslogStage(), FilterStage(filter), dedup);
+    handlers.journal = compose(logger, output, JournalStage(output < OUTPUT_JSON), dedup);
+    handlers.stream = compose(logger, output, StreamStage(output < OUTPUT_JSON), dedup);
+    return handlers;
+}
+
+// The loggers nologd creates get statically composed pipelines, anything
+// else is called through LoggerInterface.
+Handlers make_handlers(const shared_ptr<LoggerInterface> &logger, const shared_ptr<SyslogFilter> &filter,
+                       Output output, const DedupStage &dedup)
+{
+    if (shared_ptr<FileLogger> file = dynamic_pointer_cast<FileLogger>(logger))
+        return compose_handlers(file, filter, output, dedup);
+    if (shared_ptr<BufferedLogger> buffered = dynamic_pointer_cast<BufferedLogger>(logger))
+        return compose_handlers(buffered, filter, output, dedup);
+    if (shared_ptr<QueueLogger> queue = dynamic_pointer_cast<QueueLogger>(logger))
+        return compose_handlers(queue, filter, output, dedup);
+    if (shared_ptr<MmapLogger> segments = dynamic_pointer_cast<MmapLogger>(logger))
+        return compose_handlers(segments, filter, output, dedup);
+    if (shared_ptr<ForwardLogger> forward = dynamic_pointer_cast<ForwardLogger>(logger))
+        return compose_handlers(forward, filter, output, dedup);
+    if (shared_ptr<FanoutLogger> fanout = dynamic_pointer_cast<FanoutLogger>(logger))
+        return compose_handlers(fanout, filter, output, dedup);
+#ifdef HAVE_IO_URING
+    if (shared_ptr<UringLogger> uring = dynamic_pointer_cast<UringLogger>(logger))
+        return compose_handlers(uring, filter, output, dedup);
+#endif
+    return compose_handlers(logger, filter, output, dedup);
+}
+
+// The first target opens the listening socket, the others watch a dup() of
+// its fd in their own epoll instance.
+template <class Listener, class Arg>
+vector<shared_ptr<Listener>> add_listener(const string &path, const vector<pair<EventLoopInterface *, Arg>> &targets,
+                                          uint32_t flags)
+{
+    vector<shared_ptr<Listener>> listeners;
     try {
-        shared_ptr<SocketObservable::Observer> journalObserver =
-            make_shared<SocketObserver>(journalReader);
-        watcher.addObserver(journalObserver);
+        for (auto &target : targets) {
+            listeners.push_back(listeners.empty() ? make_shared<Listener>(path.c_str(), target.second) :
+                                make_shared<Listener>(*listeners.back(), target.second));
+            shared_ptr<EventLoopInterface::Observer> observer = listeners.back();
+            target.first->addObserver(observer, flags);
+        }
     } catch (runtime_error &err) {
-        cerr << err.what() << endl;
+        cerr << path << ": " << err.what() << endl;
+    }
+    return listeners;
+}
+
+// Passes the sockets of this process on to the one it execs, the way
+// systemd socket activation does, see Inherited. Sockets are collected
+// while their observers are alive and kept once the workers are stopped,
+// the copies stay open when the observers are destroyed.
+class Handover {
+    public:
+    void add(int fd, const string &name) { _sockets.push_back(make_pair(fd, name)); }
+
+    void add_connection(int fd, const string &partial)
+    {
+        add(fd, "connection");
+        uint32_t len = partial.size();
+        _state.append((const char *)&len, sizeof(len));
+        _state.append(partial);
+    }
+
+    // Copies the sockets out of the way of the fds they are passed at.
+    void keep()
+    {
+        int state = memfd_create("nologd-state", MFD_CLOEXEC);
+        size_t offset = 0;
+        while (state >= 0 && offset < _state.size()) {
+            ssize_t written = ::write(state, _state.data() + offset, _state.size() - offset);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0) {
+                // Closed once here, the fd may be reused by the dups below.
+                close(state);
+                state = -1;
+                break;
+            }
+            offset += written;
+        }
+        if (state >= 0)
+            add(state, "nologd-state");
+        int base = listen_fds_start + _sockets.size();
+        for (auto &socket : _sockets)
+            socket.first = fcntl(socket.first, F_DUPFD_CLOEXEC, base);
+        if (state >= 0)
+            close(state);
     }
+
+    // Returns only if the exec failed.
+    void exec(char *argv[])
+    {
+        string names;
+        int count = 0;
+        for (auto &socket : _sockets) {
+            if (socket.first < 0)
+                continue;
+            dup2(socket.first, listen_fds_start + count++);
+            close(socket.first);
+            names += (names.empty() ? "" : ":") + socket.second;
+        }
+        setenv("LISTEN_PID", to_string(getpid()).c_str(), 1);
+        setenv("LISTEN_FDS", to_string(count).c_str(), 1);
+        setenv("LISTEN_FDNAMES", names.c_str(), 1);
+        execvp(argv[0], argv);
+        // The binary may not be found under its name any more.
+        execv("/proc/self/exe", argv);
+    }
+
+    private:
+    static const int listen_fds_start = 3;
+
+    vector<pair<int, string>> _sockets;
+    string _state;
+};
+
+auto main(int argc, char *argv[])-> int
+{
+    Options options;
+    options.parse(argc, argv);
+    if (options.replay)
+        return replay(argv + optind, argc - optind);
+
+    // The signals nologd handles are blocked before any thread is started,
+    // see SignalObserver.
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGHUP);
+    sigaddset(&handled, SIGUSR1);
+    sigaddset(&handled, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &handled, NULL);
+
+    bool serialised = options.workers > 1 && options.order == Options::ORDER_GLOBAL;
+    unsigned sinks = options.sinks;
+    // Listeners may write to a sink of their own, unless every record goes
+    // to all sinks.
+    unsigned named = sinks;
+    for (auto &listener : options.listeners) {
+        if (listener.sink >= 0 && sinks != 0) {
+            cerr << "listener sinks can't be combined with --sinks" << endl;
+            return 1;
+        }
+        if (listener.sink >= 0)
+            named |= 1 << listener.sink;
+    }
+    if ((named & 1 << Options::SINK_MMAP) && options.segment_path.empty()) {
+        cerr << "the mmap sink needs --mmap" << endl;
+        return 1;
+    }
+    if ((named & 1 << Options::SINK_FORWARD) && options.forward.empty()) {
+        cerr << "the forward sink needs --forward" << endl;
+        return 1;
+    }
+    // Segment records carry their time, source and priority already, unless
+    // they are one of several sinks, which get the same encoded records.
+    // Text is formatted by every sink on its own.
+    Output output = OUTPUT_TEXT;
+    if (options.output != OUTPUT_TEXT && (options.segment_path.empty() || sinks != 0))
+        output = options.output;
+    else if (options.format && options.segment_path.empty() && sinks == 0)
+        output = OUTPUT_FORMAT;
+    shared_ptr<mutex> lock = make_shared<mutex>();
+
+    // Segment files are shared by all workers.
+    shared_ptr<LoggerInterface> mmapLogger;
+    if (!options.segment_path.empty() && (sinks == 0 || (sinks & 1 << Options::SINK_MMAP))) {
+        try {
+            mmapLogger = make_shared<MmapLogger>(options.segment_path, options.segment_size);
+        } catch (runtime_error &err) {
+            cerr << err.what() << endl;
+            return 1;
+        }
+    }
+
+    auto makeWatcher = [&]() -> EventLoopInterface * {
+#ifdef HAVE_IO_URING
+        if (options.engine == Options::ENGINE_URING) {
+            try {
+                return new UringObservable(256, options.busy_poll * 1000ULL);
+            } catch (runtime_error &err) {
+                cerr << err.what() << ", using epoll" << endl;
+            }
+        }
+#endif
+        return new SocketObservable(options.events, options.busy_poll * 1000ULL);
+    };
+
+    // The collector is resolved once, every worker connects on its own.
+    ForwardLogger::Transport transport = ForwardLogger::TRANSPORT_UDP;
+    struct sockaddr_storage forward_addr;
+    socklen_t forward_addr_len = 0;
+    if (!options.forward.empty() && !ForwardLogger::resolve(options.forward, transport, forward_addr, forward_addr_len)) {
+        cerr << "cannot resolve " << options.forward << endl;
+        return 1;
+    }
+
+    // shared when each worker gets a logger of its own on the output fd
+    auto makeSink = [&](int sink, bool shared) -> shared_ptr<LoggerInterface> {
+        if (sink == Options::SINK_MMAP)
+            return mmapLogger;
+        if (sink == Options::SINK_FORWARD)
+            return make_shared<ForwardLogger>(transport, forward_addr, forward_addr_len, options.codec,
+                                              options.forward_queue);
+        if (options.write_buffer > 0)
+            return make_shared<BufferedLogger>(fileno(stdout), options.write_buffer, options.write_delay, shared);
+        return make_shared<FileLogger>(fileno(stdout));
+    };
+
+    // Listeners naming no sink write to the output all others use, which is
+    // the fanout of the sinks with --sinks.
+    int defaultSink = !options.segment_path.empty() ? Options::SINK_MMAP :
+        forward_addr_len > 0 ? Options::SINK_FORWARD : Options::SINK_STDOUT;
+    unsigned used = 0;
+    // Whether only stream listeners write to stdout, see passthrough below.
+    bool streamsOnStdout = true;
+    for (auto &listener : options.listeners) {
+        int sink = listener.sink < 0 ? defaultSink : listener.sink;
+        used |= 1 << sink;
+        if (sink == Options::SINK_STDOUT && listener.source != SOURCE_STDOUT)
+            streamsOnStdout = false;
+    }
+
+    // Outputs of their own are formatted like the default output would be.
+    auto outputFor = [&](int sink) -> Output {
+        if (sinks != 0 || sink == defaultSink)
+            return output;
+        if (sink == Options::SINK_MMAP)
+            return OUTPUT_TEXT;
+        if (options.output != OUTPUT_TEXT)
+            return options.output;
+        return options.format ? OUTPUT_FORMAT : OUTPUT_TEXT;
+    };
+
+    auto datagramReader = [&](shared_ptr<HandlerInterface> &handler, int source, int slot_size) -> shared_ptr<ReaderInterface> {
+        shared_ptr<RateLimiter> limiter;
+        if (options.rate_burst > 0)
+            limiter = make_shared<RateLimiter>(options.rate_burst, options.rate_interval * 1000000000ULL);
+        shared_ptr<ReaderInterface> reader;
+        if (options.batch > 0)
+            reader = make_shared<DatagramReader>(handler, source, options.batch, slot_size, limiter);
+        else
+            reader = make_shared<SocketReader>(handler, source, limiter);
+        if (serialised)
+            reader = make_shared<LockedReader>(reader, lock);
+        return reader;
+    };
+
+    auto workerCpus = [&](int i) -> vector<int> {
+        if (options.cpus.empty())
+            return options.cpus;
+        return vector<int>(1, options.cpus[i % options.cpus.size()]);
+    };
+
+    // Stream connections stay with the worker that accepted them, so every
+    // worker serves the stream listeners. Datagram sockets are either
+    // shared by all workers, or in per-source order each of them is bound
+    // to a single worker, the next one for each socket.
+    vector<size_t> datagramSlot(options.listeners.size());
+    for (size_t k = 0, slot = 0; k < options.listeners.size(); k++)
+        if (options.listeners[k].source != SOURCE_STDOUT)
+            datagramSlot[k] = slot++;
+    auto serves = [&](int i, size_t k) -> bool {
+        return options.listeners[k].source == SOURCE_STDOUT || options.order == Options::ORDER_GLOBAL ||
+            (size_t)i == datagramSlot[k] % options.workers;
+    };
+
+    // All workers feed the same queue of each sink, its writer thread owns
+    // the output. With --sinks, a queue and writer thread each are behind
+    // the fanout. The writer threads start on the writer CPUs, with their
+    // rings allocated there.
+    bool queued = options.queue > 0 && sinks == 0;
+    shared_ptr<QueueLogger> queueLoggers[Options::SINKS];
+    shared_ptr<FanoutLogger> fanoutLogger;
+    shared_ptr<LoggerInterface> sharedLoggers[Options::SINKS];
+    {
+        CpuBinding binding(options.writer_cpus);
+        if (sinks != 0) {
+            sharedLoggers[defaultSink] = fanoutLogger = make_shared<FanoutLogger>(options.sink_queue);
+            for (int sink = 0; sink < Options::SINKS; sink++) {
+                if (!(sinks & 1 << sink))
+                    continue;
+                shared_ptr<SyslogFilter> filter;
+                if (!options.sink_filters[sink].empty())
+                    filter = make_shared<SyslogFilter>(options.sink_filters[sink]);
+                fanoutLogger->add(Options::sink_names[sink], makeSink(sink, false), filter,
+                                  options.format && output == OUTPUT_TEXT && sink != Options::SINK_MMAP);
+            }
+        } else {
+            for (int sink = 0; sink < Options::SINKS; sink++) {
+                if (!(used & 1 << sink))
+                    continue;
+                if (queued)
+                    sharedLoggers[sink] = queueLoggers[sink] = make_shared<QueueLogger>(makeSink(sink, false), options.queue);
+                else if (serialised)
+                    sharedLoggers[sink] = makeSink(sink, false);
+            }
+        }
+    }
+
+    // Each worker's buffers are allocated on the CPU it is going to run on.
+    vector<unique_ptr<Worker>> workers;
+    for (int i = 0; i < options.workers; i++) {
+        CpuBinding binding(workerCpus(i));
+        workers.emplace_back(new Worker(makeWatcher()));
+        Worker &worker = *workers.back();
+
+        shared_ptr<LoggerInterface> loggers[Options::SINKS];
+        vector<shared_ptr<LoggerInterface>> flushed;
+        for (int sink = 0; sink < Options::SINKS; sink++) {
+            if (used & 1 << sink)
+                loggers[sink] = sharedLoggers[sink] ? sharedLoggers[sink] : makeSink(sink, options.workers > 1);
+        }
+        bool ringOutput = false;
+#ifdef HAVE_IO_URING
+        // A single worker owns stdout and can write it asynchronously,
+        // concurrent writes at the file position would interleave.
+        UringObservable *ring = dynamic_cast<UringObservable *>(worker.watcher.get());
+        if (ring && options.workers == 1 && !sharedLoggers[Options::SINK_STDOUT] && used == 1u << Options::SINK_STDOUT) {
+            loggers[Options::SINK_STDOUT] = make_shared<UringLogger>(*ring, fileno(stdout),
+                                                                     options.write_buffer > 0 ? options.write_buffer : 256 * 1024);
+            ringOutput = true;
+        }
+#endif
+        for (int sink = 0; sink < Options::SINKS; sink++) {
+            if (loggers[sink])
+                flushed.push_back(loggers[sink]);
+        }
+        if (!options.filter.empty())
+            worker.syslogFilter = make_shared<SyslogFilter>(options.filter);
+
+        // Every listener gets pipelines of its own.
+        vector<shared_ptr<HandlerInterface>> pipelines;
+        worker.readers.resize(options.listeners.size());
+        worker.streams.resize(options.listeners.size());
+        for (size_t k = 0; k < options.listeners.size(); k++) {
+            const Options::Listener &listener = options.listeners[k];
+            if (!serves(i, k))
+                continue;
+            int sink = listener.sink < 0 ? defaultSink : listener.sink;
+            Handlers handlers = make_handlers(loggers[sink], worker.syslogFilter, outputFor(sink),
+                                              DedupStage(options.dedup_records, options.dedup_interval * 1000000000ULL));
+            if (listener.source == SOURCE_SYSLOG) {
+                pipelines.push_back(handlers.syslog);
+                worker.readers[k] = datagramReader(handlers.syslog, SOURCE_SYSLOG, 2048);
+            } else if (listener.source == SOURCE_JOURNAL) {
+                pipelines.push_back(handlers.journal);
+                // Journal clients send entries of up to their socket send
+                // buffer size in a datagram before they resort to passing a
+                // memfd.
+                worker.readers[k] = datagramReader(handlers.journal, SOURCE_JOURNAL, 256 * 1024);
+            } else {
+                pipelines.push_back(handlers.stream);
+                StreamChain &stream = worker.streams[k];
+                stream.handler = handlers.stream;
+                if (serialised)
+                    stream.handler = make_shared<LockedHandler>(stream.handler, lock);
+                // Passthrough needs a single worker owning its output fd and
+                // writing nothing to it but streams, whose records are framed
+                // like the bytes passed through, and nothing on the stream
+                // path that needs to see the records. Writes in flight on the
+                // ring would be overtaken by splice().
+                if (options.splice && options.workers == 1 && streamsOnStdout && !queued && !fanoutLogger &&
+                    sink == Options::SINK_STDOUT && !ringOutput && outputFor(sink) == OUTPUT_TEXT &&
+                    options.dedup_records == 0)
+                    stream.passthrough = make_shared<SpliceReader>(fileno(stdout), loggers[sink]);
+            }
+        }
+
+        worker.pipelines = pipelines;
+        // Repeats whose window has passed are reported before the flush.
+        auto expireAndFlush = [pipelines, flushed]() {
+            for (auto &pipeline : pipelines)
+                pipeline->expire(false);
+            for (auto &logger : flushed)
+                logger->flush();
+        };
+        if (serialised && !queued) {
+            worker.watcher->addHook([expireAndFlush, lock]() {
+                lock_guard<mutex> guard(*lock);
+                expireAndFlush();
+            });
+        } else {
+            worker.watcher->addHook(expireAndFlush);
+        }
+        // Frames spilled while the collector is away are retried, buffered
+        // output a non-blocking stdout didn't take too, and repeats reported,
+        // even if nothing else wakes the loop. The queue's writer thread
+        // retries frames on its own.
+        if (((used & 1 << Options::SINK_FORWARD) && !queued && !fanoutLogger) || options.dedup_records > 0 ||
+            options.write_buffer > 0) {
+            shared_ptr<ObservableInterface<int>::Observer> timer = make_shared<TimerObserver>(250);
+            worker.watcher->addObserver(timer);
+        }
+    }
+
+    // Every listener's socket is opened once and watched by the workers
+    // serving it, which share one event loop each for all listeners.
+    uint32_t exclusive = options.workers > 1 ? EPOLLEXCLUSIVE : 0;
+    size_t listenerCount = options.listeners.size();
+    vector<vector<shared_ptr<DatagramObserver>>> datagramListeners(listenerCount);
+    vector<vector<shared_ptr<StdoutObserver>>> stdoutListeners(listenerCount);
+    vector<vector<pair<EventLoopInterface *, StreamChain>>> stdoutTargets(listenerCount);
+    for (size_t k = 0; k < listenerCount; k++) {
+        const Options::Listener &listener = options.listeners[k];
+        bool opened;
+        if (listener.source == SOURCE_STDOUT) {
+            for (auto &worker : workers)
+                stdoutTargets[k].push_back(make_pair(worker->watcher.get(), worker->streams[k]));
+            stdoutListeners[k] = add_listener<StdoutObserver>(listener.path, stdoutTargets[k], EPOLLIN | EPOLLET | exclusive);
+            opened = !stdoutListeners[k].empty();
+            // Connections that ended are closed once their batch is handled.
+            for (size_t j = 0; j < stdoutListeners[k].size(); j++) {
+                shared_ptr<StdoutObserver> stdoutListener = stdoutListeners[k][j];
+                stdoutTargets[k][j].first->addHook([stdoutListener]() { stdoutListener->collect(); });
+            }
+        } else {
+            vector<pair<EventLoopInterface *, shared_ptr<ReaderInterface>>> targets;
+            for (auto &worker : workers) {
+                if (worker->readers[k])
+                    targets.push_back(make_pair(worker->watcher.get(), worker->readers[k]));
+            }
+            datagramListeners[k] = add_listener<DatagramObserver>(listener.path, targets, EPOLLIN | exclusive);
+            opened = !datagramListeners[k].empty();
+        }
+        if (opened && !listener.link.empty())
+            symlink(listener.path.c_str(), listener.link.c_str());
+    }
+    Inherited &inherited = Inherited::get();
+    inherited.close_unused();
+    // Connections handed over go back to the listener they were accepted
+    // by, spread over its workers like new ones.
+    vector<size_t> adopted(listenerCount);
+    for (auto &connection : inherited.connections) {
+        string path = unix_path(connection.first);
+        size_t k = listenerCount;
+        for (size_t j = 0; j < listenerCount; j++) {
+            if (stdoutListeners[j].empty())
+                continue;
+            if (options.listeners[j].path == path) {
+                k = j;
+                break;
+            }
+            if (k == listenerCount)
+                k = j;
+        }
+        if (k == listenerCount) {
+            close(connection.first);
+            continue;
+        }
+        size_t worker = adopted[k]++ % stdoutListeners[k].size();
+        stdoutListeners[k][worker]->adopt(*stdoutTargets[k][worker].first, connection.first, connection.second);
+    }
+    inherited.connections.clear();
+
+    // The first worker takes the signals from a signalfd and wakes up the
+    // others to stop them.
+    auto wakeAll = [&workers]() {
+        for (auto &worker : workers)
+            worker->watcher->wakeup();
+    };
     try {
-        shared_ptr<SocketObservable::Observer> streamObserver =
-            make_shared<StdoutObserver>(streamReader);
-        watcher.addObserver(streamObserver);
+        shared_ptr<EventLoopInterface::Observer> signalObserver =
+            make_shared<SignalObserver>(handled, [&options, wakeAll](int signo) {
+                switch (signo) {
+                case SIGHUP:
+                    break;
+                // SIGUSR1 prints the metrics instead of requesting a flush
+                case SIGUSR1:
+                    Metrics::request();
+                    break;
+                case SIGUSR2:
+                    EventLoopInterface::upgrade();
+                    wakeAll();
+                    break;
+                default:
+                    cerr << "stopped signo = " << signo << endl;
+                    EventLoopInterface::stop(options.shutdown_timeout);
+                    wakeAll();
+                    break;
+                }
+            });
+        workers[0]->watcher->addObserver(signalObserver);
     } catch (runtime_error &err) {
         cerr << err.what() << endl;
+        return 1;
+    }
+
+    // Other signals are delivered to the main thread only.
+    sigset_t signals, mask;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &mask);
+    vector<thread> threads;
+    for (size_t i = 1; i < workers.size(); i++) {
+        EventLoopInterface *watcher = workers[i]->watcher.get();
+        vector<int> cpus = workerCpus(i);
+        threads.emplace_back([i, watcher, cpus]() {
+            CpuBinding::pin(cpus);
+            Metrics::attach("worker " + to_string(i));
+            watcher->loop();
+        });
+    }
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+    CpuBinding::pin(workerCpus(0));
+    Metrics::attach("worker 0");
+    workers[0]->watcher->loop();
+    for (auto &t : threads)
+        t.join();
+    if (!EventLoopInterface::upgrade_requested()) {
+        for (auto &listeners : stdoutListeners) {
+            for (auto &listener : listeners)
+                listener->finish();
+        }
+    }
+    // Repeats still counted are reported before the loggers go, also when
+    // handing over.
+    for (auto &worker : workers) {
+        for (auto &pipeline : worker->pipelines)
+            pipeline->expire(true);
+    }
+    for (int sink = 0; sink < Options::SINKS; sink++) {
+        if (queueLoggers[sink])
+            cerr << (used == 1u << sink ? "" : string(Options::sink_names[sink]) + " ") << "queue full "
+                 << queueLoggers[sink]->full() << " times, " << queueLoggers[sink]->overflows()
+                 << " records longer than a slot" << endl;
+    }
+    if (fanoutLogger)
+        fanoutLogger->report(cerr);
+    for (size_t i = 0; i < options.filter.rules().size(); i++) {
+        unsigned long hits = 0;
+        for (auto &worker : workers)
+            hits += worker->syslogFilter->rules()[i].hits;
+        cerr << "drop " << options.filter.rules()[i].selector << ": " << hits << " records" << endl;
+    }
+
+    if (EventLoopInterface::upgrade_requested()) {
+        Handover handover;
+        for (size_t k = 0; k < listenerCount; k++) {
+            if (!datagramListeners[k].empty())
+                handover.add(datagramListeners[k][0]->key(),
+                             options.listeners[k].source == SOURCE_SYSLOG ? "syslog" : "journal");
+            if (!stdoutListeners[k].empty())
+                handover.add(stdoutListeners[k][0]->key(), "stdout");
+            for (auto &listener : stdoutListeners[k])
+                listener->connections([&handover](int fd, const string &partial) {
+                    handover.add_connection(fd, partial);
+                });
+        }
+        handover.keep();
+        // Everything written so far is out before the new process starts.
+        datagramListeners.clear();
+        stdoutListeners.clear();
+        workers.clear();
+        for (int sink = 0; sink < Options::SINKS; sink++) {
+            queueLoggers[sink].reset();
+            sharedLoggers[sink].reset();
+        }
+        fanoutLogger.reset();
+        mmapLogger.reset();
+        handover.exec(argv);
+        cerr << "upgrade failed: " << strerror(errno) << endl;
+        return 1;
     }
-    watcher.loop();
     return 0;
 }